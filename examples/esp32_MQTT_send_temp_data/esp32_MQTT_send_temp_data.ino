@@ -31,62 +31,41 @@ void setup()
     temp = oneWireTemp.getTempCByIndex(0);                 // Get temperature from DS18B20 sensor
     Serial.println("\nTemp: " + String(temp) + " °C");     // Print temperature to serial monitor
 
-    Serial.println("\nTurn off deep sleep mode");
-    if(quectel.setDeepSleep()){                             // Turn of deep sleep mode
-        Serial.println("\tDeep sleep mode turned off");
-    }
-    else{
-        Serial.println("\tDeep sleep mode turn off failed");
-    }
-    delay(1000);
-
-    Serial.println("\nOpen MQTT connection");
-    if(quectel.openMQTT("0.0.0.0")){	                    // Open UDP socket, replace 0.0.0.0 with your host IP adress and 0 with your PORT number
-        Serial.println("\tMQTT connection opened");
-    }
-    else{
-        Serial.println("\tFailed to open MQTT connection");
-    }
-    delay(1000);
-
-    Serial.println("\nConnect to MQTT broker");
-    if(quectel.connectMQTT("Test-123456")){                 // Connect to MQTT broker, first parameter is client ID
-        Serial.println("\tConnected to MQTT broker");
-    }
-    else{
-        Serial.println("\tFailed to connect to MQTT broker");
-    }
-    delay(1000);
+    String lastTemp = String(temp);
+    QuectelBC660::sequenceStep steps[] = {                  // Whole duty cycle as one sequence, steps: action, text, data, value, option, run condition
+        {SEQUENCE_SLEEP, nullptr, nullptr, 0},              // Turn off deep sleep mode
+        {SEQUENCE_OPEN_MQTT, "0.0.0.0", nullptr, 1883},     // Open MQTT connection, replace 0.0.0.0 with address of your MQTT broker
+        {SEQUENCE_CONNECT_MQTT, "Test-123456"},             // Connect to MQTT broker, text is client ID
+        {SEQUENCE_PUBLISH_MQTT, "MQTT/TOPIC", lastTemp.c_str(), (uint16_t)lastTemp.length()},  // Publish temperature reading, text is MQTT topic
+        {SEQUENCE_CLOSE_MQTT},                              // Close MQTT connection
+        {SEQUENCE_CLOSE_MQTT, nullptr, nullptr, 0, 0, SEQUENCE_ON_FAILURE},  // Close MQTT connection if any step failed
+        {SEQUENCE_SLEEP, nullptr, nullptr, 1, 0, SEQUENCE_ALWAYS}             // Turn on deep sleep mode in any case
+    };
+    const char* names[] = {"Turn off deep sleep mode", "Open MQTT connection", "Connect to MQTT broker", "Publish temperature reading", "Close MQTT connection", "Close MQTT connection after failure", "Turn on deep sleep mode"};
+    QuectelBC660::stepResultStruct results[7];
 
     Serial.println("\nPublish temperature reading to MQTT broker");
-    String lastTemp = String(temp);
-    int lastTempLength = lastTemp.length();
-    if(quectel.publishMQTT(lastTemp.c_str(), lastTempLength, "MQTT/TOPIC")){  // Publish temperature reading to MQTT broker, first parameter is data to be sent, second parameter is data length, third parameter is MQTT topic
-        Serial.println("\tTemperature reading published to MQTT broker");
+    uint8_t failed = quectel.runSequence(steps, 7, results);   // Run the steps, returns index of the first failed step (7 = all succeeded)
+    for(uint8_t i = 0; i < 7; i++){
+        if(results[i].executed){
+            Serial.print("\t");
+            Serial.print(names[i]);
+            if(results[i].succeeded){
+                Serial.println(": done in " + String(results[i].duration) + " ms");
+            }
+            else{
+                Serial.println(": failed");
+            }
+        }
     }
-    else{
-        Serial.println("\tFailed to publish temperature reading to MQTT broker");
-    }
-    delay(1000);
-
-    Serial.println("\nClose MQTT connection");
-    if(quectel.closeMQTT()){                                // Close MQTT connection
-        Serial.println("\tMQTT connection closed");
+    if(failed == 7){
+        Serial.println("\tTemperature reading published to MQTT broker");
     }
     else{
-        Serial.println("\tFailed to close MQTT connection");
+        Serial.print("\tFailed at step: ");
+        Serial.println(names[failed]);
     }
-    delay(1000);
 
-    Serial.println("\nTurn on deep sleep mode");
-    if(quectel.setDeepSleep(1)){                            // Turn on deep sleep mode, first parameter is deep sleep time in seconds
-        Serial.println("\tDeep sleep mode turned on");
-    }
-    else{
-        Serial.println("\tFailed to turn on deep sleep mode");
-    }
-    delay(1000);
-    
     Serial.println("\nGoing to sleep for 30 seconds...");
     delay(10);
     esp_sleep_enable_timer_wakeup(30000000);                // Deep sleep for 30 seconds
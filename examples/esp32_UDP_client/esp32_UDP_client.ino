@@ -36,7 +36,7 @@ void setup()
     delay(1000);
 
     Serial.println("Send data to host");
-    if(quectel.sendDataUDP("Hello world!", 12)){            // Send data to host, first parameter is data, second parameter is data length
+    if(quectel.sendDataUDP("Hello world!", 12, RAI_NO_REPLY)){  // Send data to host, first parameter is data, second parameter is data length, third parameter lets the module release the radio connection right after the send
         Serial.println("Data sent");
     }
     else{
@@ -54,13 +54,8 @@ void setup()
     delay(1000);
     Serial.println("======UDP SEND DONE======");
 
-    Serial.println("Reenable deep sleep mode");
-    if(quectel.setDeepSleep(1)){                            // Turn on deep sleep mode
-        Serial.println("Deep sleep mode turned on");
-    }
-    else{
-        Serial.println("Failed to turn on deep sleep mode");
-    }
+    Serial.print("Sleep mode until next send: ");
+    Serial.println(quectel.planSleep(30000));               // Choose sleep mode of the module, first parameter is time to the next send in milliseconds
     delay(1000);
     
     Serial.println("\nGoing to sleep for 30 seconds...");
@@ -33,10 +33,30 @@ bool QuectelBC660::begin(HardwareSerial *uart)
     return true;
 }
 
+void QuectelBC660::setDebugStream(Print* stream)
+{
+    // Debug output goes to Serial by default, with several modules each one can log to its own stream
+    _debugStream = stream;
+}
+
 // Status and information
 const char* QuectelBC660::getFirmwareVersion()
 {
-	return _firmwareVersion;
+    // Reply is:
+    // Revision: BC660KGLAAR01A01
+    //
+    // OK
+    wakeUp();
+    if (sendAndWaitForReply("AT+CGMR", 1000, 3))
+    {
+        char * token = strtok(_buffer, "\n");
+        if (token && strncmp(token, "Revision: ", 10) == 0)
+        {
+            // Points into the reply buffer, valid until the next command
+            return token + 10;
+        }
+    }
+    return "ERROR";
 }
 
 int8_t QuectelBC660::getRSSI()
@@ -117,27 +137,27 @@ uint8_t QuectelBC660::getBER()
 
 const char* QuectelBC660::getDateAndTime()
 {
-    // Response: +CCLK: <time>
-    // Time: String type. The format is "YY/MM/DD,hh:mm:ss±zz", where characters indicate
-    // year (two last digits), month, day, hour, minute, second and time zone (indicates
-    // the difference, expressed in quarters of an hour, between the local time and GMT;
-    // the range is -96 to +96.) For instance, 6th of May 2014, 22:10:00 GMT+2 hours
-    // equals "14/05/06,22:10:00+08"
-
-	// Reply is:
-    // +CCLK: 20/11/03,06:25:06+32
-    // 
-    // OK
-    wakeUp();
-    if (sendAndWaitForReply("AT+CCLK?", 1000, 3))
+    // Time is served by the local time service in the +CCLK format "YY/MM/DD,hh:mm:ss±zz", where
+    // zz is the difference between the local time and GMT expressed in quarters of an hour
+    time_t local = getLocalEpoch();
+    if (local != 0)
     {
-        char * token = strtok(_buffer, "\n");
-        if (token)
-        if (strlen(token) > 7)
-        {
-            strcpy(_dateAndTime, token + 7);
-            return _dateAndTime;
-        }
+        // Civil date from days since 1970-01-01 (inverse of the conversion in parseDateTime())
+        int32_t days = local / 86400;
+        int32_t seconds = local % 86400;
+        days += 719468;
+        int32_t era = days / 146097;
+        int32_t dayOfEra = days - era * 146097;
+        int32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        int32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        int32_t monthIndex = (5 * dayOfYear + 2) / 153;
+        int day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+        int month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+        int year = yearOfEra + era * 400 + (month <= 2);
+        // Formatted into the reply buffer, valid until the next command
+        snprintf(_buffer, sizeof(_buffer), "%02d/%02d/%02d,%02d:%02d:%02d%c%02d", year % 100, month, day,
+                (int)(seconds / 3600), (int)(seconds / 60 % 60), (int)(seconds % 60), _timezone < 0 ? '-' : '+', abs(_timezone));
+        return _buffer;
     }
     return "ERROR";
 }
@@ -212,39 +232,47 @@ const char* QuectelBC660::getStatus()
 
 bool QuectelBC660::setDeepSleep(uint8_t sleepMode)
 {
-    _sleepMode = sleepMode;
+    // The module is woken with the mode in effect, wakeUp() does nothing once sleep is set disabled
     wakeUp();
-    if(_sleepMode == 1)
+    bool set;
+    if(sleepMode == 1)
     {
         if(_debug != false){
-        Serial.println("\nEnabling light sleep and deep sleep!");
+        _debugStream->println("\nEnabling light sleep and deep sleep!");
         }
-        sendAndCheckReply("AT+QSCLK=1", _OK, 1000);
-        return true;
+        set = sendAndCheckReply("AT+QSCLK=1", _OK, 1000);
     }
-    else if(_sleepMode == 2)
+    else if(sleepMode == 2)
     {
         if(_debug != false){
-        Serial.println("Enabling light sleep only!");
+        _debugStream->println("Enabling light sleep only!");
         }
-        sendAndCheckReply("AT+QSCLK=2", _OK, 1000);
-        return true;
+        set = sendAndCheckReply("AT+QSCLK=2", _OK, 1000);
     }
     else
     {
         if(_debug != false){
-        Serial.println("Disabling sleep modes!");
+        _debugStream->println("Disabling sleep modes!");
         }
-        sendAndCheckReply("AT+QSCLK=0", _OK, 1000);
-        return true;
+        sleepMode = 0;
+        set = sendAndCheckReply("AT+QSCLK=0", _OK, 1000);
     }
-    return false;
+    if (set)
+    {
+        _sleepMode = sleepMode;
+    }
+    return set;
 }
 
 bool QuectelBC660::wakeUp()
 {
+    // Module is kept awake during a command sequence, it was woken at the start of it
+    if(_holdAwake)
+    {
+        return true;
+    }
     if(_debug != false){
-        Serial.print("\n(Wakeup: ");
+        _debugStream->print("\n(Wakeup: ");
     }
     /*if(_sleepMode == NULL)
     {
@@ -266,11 +294,11 @@ bool QuectelBC660::wakeUp()
     if(_sleepMode != 0)
     {
         if(_debug != false){
-            Serial.print("Waking up module with: ");
+            _debugStream->print("Waking up module with: ");
         }
         if(_wakeUpPin != NOT){
             if(_debug != false){
-            Serial.println("PSM_EINT pin!)");
+            _debugStream->println("PSM_EINT pin!)");
             }
             digitalWrite(_wakeUpPin, HIGH);
             delay(300);
@@ -281,7 +309,7 @@ bool QuectelBC660::wakeUp()
         else 
         {
             if(_debug != false){
-            Serial.println("AT command!)");
+            _debugStream->println("AT command!)");
             }
             sendAndCheckReply("AT", _OK, 1000);
             delay(100);
@@ -291,7 +319,7 @@ bool QuectelBC660::wakeUp()
     else
     {
         if(_debug != false){
-            Serial.println("sleep mode disabled!)");
+            _debugStream->println("sleep mode disabled!)");
         }
         return false;
     }
@@ -314,8 +342,8 @@ const char* QuectelBC660::getPSM()
         if (token)
         if (strlen(token) > 8)
         {
-            strcpy(_psm, token);
-            return _psm;
+            // Points into the reply buffer, valid until the next command
+            return token;
         }
     }
     return "ERROR";
@@ -356,11 +384,165 @@ bool QuectelBC660::setPSM(const char* requested_periodic_TAU, const char* reques
                 // 1 1 1 = value indicates that the timer is deactivated
 
 
-    sprintf(_buffer, "AT+CPSMS=%d,,,\"%s\",\"%s\"", mode, requested_periodic_TAU, requested_active_time);
+    if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+CPSMS=%d,,,\"%s\",\"%s\"", mode, requested_periodic_TAU, requested_active_time)))
+    {
+        return false;
+    }
+#if QUECTEL_BC660_SLEEP_CONTROL
+    _psmChecked = false;
+#endif
     wakeUp();
     return sendAndCheckReply(_buffer, _OK, 1000);
 }
 
+#if QUECTEL_BC660_SLEEP_CONTROL
+// Sleep controller
+// Energy model of the module between two transmissions, charge in uA*s:
+//   awake (QSCLK=0):  idle current for the whole gap, no wake needed
+//   light (QSCLK=2):  light sleep current for the whole gap, PSM_EINT pulse to wake
+//   deep  (QSCLK=1):  light sleep until the granted active time (T3324) expires, PSM after that,
+//                     wake pulse plus RRC connection setup on wake
+// The mode with the lowest charge whose wake latency fits the limit is used.
+#define SLEEP_CURRENT_AWAKE 1500        // Idle with sleep disabled [uA]
+#define SLEEP_CURRENT_LIGHT 60          // Light sleep with DRX paging [uA]
+#define SLEEP_CURRENT_PSM 3             // PSM [uA]
+#define SLEEP_WAKE_LATENCY_LIGHT 400    // Wake pulse (see wakeUp()) [ms]
+#define SLEEP_WAKE_LATENCY_DEEP 2000    // Wake pulse and RRC connection setup after PSM [ms]
+#define SLEEP_WAKE_CHARGE_LIGHT 600     // [uA*s]
+#define SLEEP_WAKE_CHARGE_DEEP 60000    // [uA*s]
+
+bool QuectelBC660::updateGrantedPSM()
+{
+    // Granted timers are only reported with <n>=4:
+    // +CEREG: 4,<stat>,[<tac>],[<ci>],[<AcT>],,,[<Active-Time>],[<Periodic-TAU>]
+    // Timers are coded as in AT+CPSMS (see setPSM())
+    // <n> also enables +CEREG URCs, the previous <n> is restored after the read
+    wakeUp();
+    int n = 0;
+    if (!sendAndWaitForReply("AT+CEREG?", 1000, 3) || sscanf(_buffer, "+CEREG: %d", &n) != 1)
+    {
+        return false;
+    }
+    const char* timers[2] = {nullptr, nullptr};
+    if (sendAndCheckReply("AT+CEREG=4", _OK, 1000) && sendAndWaitForReply("AT+CEREG?", 1000, 3))
+    {
+        const char* quote = _buffer;
+        while ((quote = strchr(quote, '"')) != nullptr)
+        {
+            quote++;
+            if (strspn(quote, "01") == 8 && quote[8] == '"')
+            {
+                timers[0] = timers[1];
+                timers[1] = quote;
+                quote += 9;
+            }
+        }
+    }
+    uint8_t active = timers[0] ? strtol(timers[0], nullptr, 2) : 0;
+    uint8_t tau = timers[0] ? strtol(timers[1], nullptr, 2) : 0;
+    char restore[14];
+    snprintf(restore, sizeof(restore), "AT+CEREG=%d", n);
+    sendAndCheckReply(restore, _OK, 1000);
+    if (timers[0] == nullptr)
+    {
+        // Not registered or PSM not granted by the network
+        _psmGranted = false;
+        return false;
+    }
+    static const uint16_t activeUnits[8] = {2, 60, 360, 0, 0, 0, 0, 0};
+    static const uint32_t tauUnits[8] = {600, 3600, 36000, 2, 30, 60, 1152000, 0};
+    _grantedActiveTime = (uint32_t)(active & 0x1F) * activeUnits[active >> 5];
+    _grantedTAU = (uint32_t)(tau & 0x1F) * tauUnits[tau >> 5];
+    _psmGranted = (active >> 5) != 7 && (tau >> 5) != 7;
+    if(_debug != false)
+    {
+        _debugStream->print("\nGranted active time [s]: ");
+        _debugStream->print(_grantedActiveTime);
+        _debugStream->print(", periodic TAU [s]: ");
+        _debugStream->println(_grantedTAU);
+    }
+    return _psmGranted;
+}
+
+uint32_t QuectelBC660::getGrantedActiveTime()
+{
+    return _grantedActiveTime;
+}
+
+uint32_t QuectelBC660::getGrantedTAU()
+{
+    return _grantedTAU;
+}
+
+uint8_t QuectelBC660::planSleep(uint32_t nextSend, uint32_t maxWakeLatency)
+{
+    // nextSend: time to the next planned transmission [ms]
+    // maxWakeLatency: longest acceptable delay of that transmission caused by waking the module [ms]
+    // Returns the sleep mode in effect (AT+QSCLK value), AT+QSCLK is only sent when the mode changes.
+    // Granted timers are read once (again after setPSM()), call updateGrantedPSM() after re-registration.
+    if (!_psmChecked)
+    {
+        updateGrantedPSM();
+        _psmChecked = true;
+    }
+    uint64_t charge[3];
+    charge[0] = (uint64_t)SLEEP_CURRENT_AWAKE * nextSend / 1000;
+    charge[2] = (uint64_t)SLEEP_CURRENT_LIGHT * nextSend / 1000 + SLEEP_WAKE_CHARGE_LIGHT;
+    charge[1] = (uint64_t)-1;
+    uint64_t activeTime = (uint64_t)_grantedActiveTime * 1000;
+    if (_psmGranted && nextSend > activeTime && maxWakeLatency >= SLEEP_WAKE_LATENCY_DEEP)
+    {
+        charge[1] = (SLEEP_CURRENT_LIGHT * activeTime + (uint64_t)SLEEP_CURRENT_PSM * (nextSend - activeTime)) / 1000 + SLEEP_WAKE_CHARGE_DEEP;
+    }
+    if (maxWakeLatency < SLEEP_WAKE_LATENCY_LIGHT)
+    {
+        charge[2] = (uint64_t)-1;
+    }
+    uint8_t mode = 0;
+    for (uint8_t i = 1; i < 3; i++)
+    {
+        if (charge[i] < charge[mode])
+        {
+            mode = i;
+        }
+    }
+
+    // The decision is only logged when the module took the mode
+    bool changed = mode != _sleepMode;
+    if (changed && !setDeepSleep(mode))
+    {
+        sleepStats.failedCommands++;
+        if(_debug != false)
+        {
+            _debugStream->println("\nSleep plan not applied");
+        }
+        return _sleepMode;
+    }
+    sleepDecisionStruct* decision = &sleepLog[sleepStats.decisions % SLEEP_LOG_SIZE];
+    decision->time = millis();
+    decision->nextSend = nextSend;
+    decision->mode = mode;
+    decision->charge = charge[mode] > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)charge[mode];
+    decision->changed = changed;
+    sleepStats.decisions++;
+    sleepStats.modes[mode]++;
+    if (!changed)
+    {
+        sleepStats.skippedCommands++;
+    }
+    if(_debug != false)
+    {
+        _debugStream->print("\nSleep plan: next send in [ms]: ");
+        _debugStream->print(nextSend);
+        _debugStream->print(", QSCLK: ");
+        _debugStream->print(mode);
+        _debugStream->print(", estimated charge [uAs]: ");
+        _debugStream->println(decision->charge);
+    }
+    return mode;
+}
+#endif
+
 // Network functions
 bool QuectelBC660::setDefaultAPN(const char* PDP_type, const char* APN, const char* username, const char* password, uint8_t auth_type, uint32_t timeout)
 {
@@ -368,13 +550,18 @@ bool QuectelBC660::setDefaultAPN(const char* PDP_type, const char* APN, const ch
     // AT+QCGDEFCONT=<PDP_type>,<APN>[,<username>,<password>[,<auth_type>]]
     // PDP_type: String type (IP, IPV6, IPV4V6, Non-IP)
 
+    int length;
     if(auth_type =! 0)
     {
-        sprintf(_buffer, "AT+QCGDEFCONT=\"%s\",\"%s\",\"%s\",\"%s\",%d", PDP_type, APN, username, password, auth_type);
+        length = snprintf(_buffer, sizeof(_buffer), "AT+QCGDEFCONT=\"%s\",\"%s\",\"%s\",\"%s\",%d", PDP_type, APN, username, password, auth_type);
     } 
     else 
     {
-        sprintf(_buffer, "AT+QCGDEFCONT=\"%s\",\"%s\"", PDP_type, APN);
+        length = snprintf(_buffer, sizeof(_buffer), "AT+QCGDEFCONT=\"%s\",\"%s\"", PDP_type, APN);
+    }
+    if (!commandFits(length))
+    {
+        return false;
     }
     wakeUp();
     return sendAndCheckReply(_buffer, _OK, timeout);
@@ -387,8 +574,8 @@ bool QuectelBC660::getRegistrationStatus(uint8_t noOfTries, uint32_t delayBetwee
     {
         uint8_t statusCode = getStatusCode();
         if(_debug != false){
-            Serial.print("\nStatus code: ");
-            Serial.println(statusCode);
+            _debugStream->print("\nStatus code: ");
+            _debugStream->println(statusCode);
         }
         if(statusCode == 1 || statusCode == 5)
         {
@@ -419,11 +606,14 @@ bool QuectelBC660::autoRegisterToNetwork(uint32_t timeout)
     // Write command: AT+COPS=0
     // Mode: 0 = automatic, 1 = manual operator sel, 2 = manualy deregister from network, 3 = Set <format> not shown in read command response, 4 = Manual/automatic selected. If manual selection fails, automatic mode(<mode>=0) is entered
     wakeUp();
-    if (sendAndWaitFor("AT+COPS=0", _IP, timeout))
-    {
-        return true;
-    }
-    return false;
+#if QUECTEL_BC660_ENGINEERING
+    uint32_t start = millis();
+#endif
+    bool attached = sendAndWaitFor("AT+COPS=0", _IP, timeout);
+#if QUECTEL_BC660_ENGINEERING
+    recordAttach(attached, millis() - start);
+#endif
+    return attached;
 }
 
 bool QuectelBC660::manualRegisterToNetwork(const char* operatorName, uint8_t mode, uint8_t format, uint32_t timeout)
@@ -433,19 +623,29 @@ bool QuectelBC660::manualRegisterToNetwork(const char* operatorName, uint8_t mod
     // <format>: 0 = long alphanumeric, 1 = short alphanumeric, 2 = numeric
     // <oper>: Operator name or numeric code
     wakeUp();
-    sprintf(_buffer, "AT+COPS=%d,%d,\"%s\"", mode, format, operatorName);
-    if (sendAndWaitFor(_buffer, _IP, timeout))
+    if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+COPS=%d,%d,\"%s\"", mode, format, operatorName)))
     {
-        return true;
+        return false;
     }
-    return false;
+#if QUECTEL_BC660_ENGINEERING
+    uint32_t start = millis();
+#endif
+    bool attached = sendAndWaitFor(_buffer, _IP, timeout);
+#if QUECTEL_BC660_ENGINEERING
+    recordAttach(attached, millis() - start);
+#endif
+    return attached;
 }
 
 
 bool QuectelBC660::setAutoBand(bool deregistred, uint32_t timeout)
 {
+#if QUECTEL_BC660_ENGINEERING
+    _bandsSet = true;
+    _numOfBands = 0;
+#endif
     wakeUp();
-    sprintf(_buffer, "AT+QBAND=0");
+    snprintf(_buffer, sizeof(_buffer), "AT+QBAND=0");
     if(deregistred)
     {    
         if (sendAndWaitFor(_buffer, _OK, timeout))
@@ -464,12 +664,36 @@ bool QuectelBC660::setAutoBand(bool deregistred, uint32_t timeout)
 }
 
 bool QuectelBC660::setManualBand(uint8_t numOfBands, uint8_t *bands, bool deregistred, uint32_t timeout)
+{
+    numOfBands = min(numOfBands, (uint8_t)BAND_LIST_SIZE);
+#if QUECTEL_BC660_ENGINEERING
+    // Kept for the full scan of attachToNetwork(), which changes AT+QBAND
+    _bandsSet = true;
+    _numOfBands = numOfBands;
+    memcpy(_bands, bands, numOfBands);
+#endif
+    return writeBands(numOfBands, bands, deregistred, timeout);
+}
+
+bool QuectelBC660::writeBands(uint8_t numOfBands, uint8_t *bands, bool deregistred, uint32_t timeout)
 {
     wakeUp();
-    sprintf(_buffer, "AT+QBAND=%d", numOfBands);
+    numOfBands = min(numOfBands, (uint8_t)BAND_LIST_SIZE);
+    uint8_t ordered[BAND_LIST_SIZE];
+    memcpy(ordered, bands, numOfBands);
+#if QUECTEL_BC660_ENGINEERING
+    if (_bandLearning)
+    {
+        // The module searches the bands in the given order, bands with the shortest expected attach go first
+        orderBands(numOfBands, ordered);
+        _numOfLastBands = numOfBands;
+        memcpy(_lastBands, ordered, numOfBands);
+    }
+#endif
+    snprintf(_buffer, sizeof(_buffer), "AT+QBAND=%d", numOfBands);
     for(uint8_t i = 0; i < numOfBands; i++)
     {
-        sprintf(_buffer, "%s,%d", _buffer, bands[i]);
+        snprintf(_buffer + strlen(_buffer), sizeof(_buffer) - strlen(_buffer), ",%d", ordered[i]);
     }
     if(deregistred)
     {    
@@ -488,14 +712,222 @@ bool QuectelBC660::setManualBand(uint8_t numOfBands, uint8_t *bands, bool deregi
     return false;
 }
 
+#if QUECTEL_BC660_DNS_CACHE
+// DNS cache
+// Entries are keyed by a hash of the host name (FNV-1a), so the cache does not store the names
+static uint32_t hostHash(const char* host)
+{
+    uint32_t hash = 2166136261UL;
+    while (*host)
+    {
+        hash = (hash ^ (uint8_t)*host++) * 16777619UL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+static bool isAddress(const char* host)
+{
+    // IPv4 or IPv6 address literal
+    return strspn(host, "0123456789.") == strlen(host) || strchr(host, ':') != nullptr;
+}
+
+void QuectelBC660::setDNSCache(bool enable)
+{
+    // openMQTT() and openUDP() use cached addresses instead of host names, entries expire after
+    // the TTL reported by the DNS server (needs the clock, see syncClock())
+    _dnsCache = enable;
+}
+
+void QuectelBC660::setDNSCacheStore(dnsCacheStruct* cache)
+{
+    // Array of DNS_CACHE_SIZE entries kept by the application, e.g. in RTC memory or flash
+    _dnsCacheEntries = cache;
+}
+
+void QuectelBC660::invalidateHost(const char* host)
+{
+    uint32_t hash = hostHash(host);
+    for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+    {
+        if (_dnsCacheEntries[i].hostHash == hash)
+        {
+            _dnsCacheEntries[i].hostHash = 0;
+        }
+    }
+}
+
+const char* QuectelBC660::resolveHost(const char* host)
+{
+    // Returns the address of host (cached or resolved now), or nullptr when resolution failed
+    if (isAddress(host))
+    {
+        return host;
+    }
+    if (!_dnsCache)
+    {
+        return queryDNS(host);
+    }
+    bool cached;
+    const char* address = lookupHost(host, &cached);
+    return address != host ? address : nullptr;
+}
+
+const char* QuectelBC660::lookupHost(const char* host, bool* cached)
+{
+    // Address literals and a disabled cache pass the host through, as does a failed resolution
+    // (AT+QMTOPEN/AT+QIOPEN then resolve the name themselves)
+    *cached = false;
+    if (!_dnsCache || isAddress(host))
+    {
+        return host;
+    }
+    uint32_t hash = hostHash(host);
+    time_t now = getEpoch();
+    for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+    {
+        dnsCacheStruct* entry = &_dnsCacheEntries[i];
+        if (entry->hostHash != hash)
+        {
+            continue;
+        }
+        // Without the clock the expiry can not be checked, the entry is used until an open fails
+        if (entry->expires == 0 || now == 0 || now < entry->expires)
+        {
+            dnsStats.hits++;
+            *cached = true;
+            if(_debug != false)
+            {
+                _debugStream->print("\nDNS cache hit: ");
+                _debugStream->println(entry->IP);
+            }
+            return entry->IP;
+        }
+        entry->hostHash = 0;
+    }
+    dnsStats.misses++;
+    const char* address = queryDNS(host);
+    return address ? address : host;
+}
+
+const char* QuectelBC660::reresolveHost(const char* host)
+{
+    dnsStats.reresolutions++;
+    invalidateHost(host);
+    return queryDNS(host);
+}
+
+const char* QuectelBC660::queryDNS(const char* host)
+{
+    // Write command: AT+QIDNSGIP=<contextID>,<hostname>
+    // Reply is:
+    // OK
+    //
+    // +QIURC: "dnsgip",<err>,<IP_count>,<DNS_server_time_to_live>
+    //
+    // +QIURC: "dnsgip",<hostIPaddr>
+    wakeUp();
+    if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QIDNSGIP=0,\"%s\"", host)))
+    {
+        return nullptr;
+    }
+    int err = -1, count = 0;
+    unsigned long ttl = 0;
+    if (sendAndWaitForReply(_buffer, ONE_MIN, 3))
+    {
+        const char* urc = strstr(_buffer, "\"dnsgip\",");
+        if (urc)
+        {
+            sscanf(urc, "\"dnsgip\",%d,%d,%lu", &err, &count, &ttl);
+        }
+    }
+    if (err != 0 || count == 0 || !readReply(FIVE_SEC, 1))
+    {
+        dnsStats.failures++;
+        if(_debug != false)
+        {
+            _debugStream->print("\nDNS query failed, error: ");
+            _debugStream->println(err);
+        }
+        return nullptr;
+    }
+    const char* address = strstr(_buffer, "\"dnsgip\",\"");
+    if (address == nullptr)
+    {
+        dnsStats.failures++;
+        return nullptr;
+    }
+    address += 10;
+    size_t len = strcspn(address, "\"");
+
+    // Free entry, otherwise the one expiring first
+    dnsCacheStruct* entry = &_dnsCacheEntries[0];
+    for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+    {
+        if (_dnsCacheEntries[i].hostHash == 0)
+        {
+            entry = &_dnsCacheEntries[i];
+            break;
+        }
+        if (_dnsCacheEntries[i].expires < entry->expires)
+        {
+            entry = &_dnsCacheEntries[i];
+        }
+    }
+    if (len >= sizeof(entry->IP))
+    {
+        dnsStats.failures++;
+        return nullptr;
+    }
+    memcpy(entry->IP, address, len);
+    entry->IP[len] = 0;
+    entry->hostHash = hostHash(host);
+    time_t now = getEpoch();
+    entry->expires = now != 0 ? now + ttl : 0;
+    if(_debug != false)
+    {
+        _debugStream->print("\nDNS resolved: ");
+        _debugStream->print(entry->IP);
+        _debugStream->print(", TTL [s]: ");
+        _debugStream->println(ttl);
+    }
+    return entry->IP;
+}
+#endif
+
+#if QUECTEL_BC660_MQTT
 // MQTT functions
 bool QuectelBC660::openMQTT(const char* host, uint16_t port, uint8_t TCPconnectID)
+{
+    // Host name is replaced by its cached address when the DNS cache is enabled. If the open
+    // fails with a cached address, the name is resolved again and the open is retried once.
+#if QUECTEL_BC660_DNS_CACHE
+    bool cached = false;
+    const char* address = lookupHost(host, &cached);
+    if (openMQTTSocket(address, port, TCPconnectID))
+    {
+        return true;
+    }
+    if (!cached)
+    {
+        return false;
+    }
+    address = reresolveHost(host);
+    return address != nullptr && openMQTTSocket(address, port, TCPconnectID);
+#else
+    return openMQTTSocket(host, port, TCPconnectID);
+#endif
+}
+
+bool QuectelBC660::openMQTTSocket(const char* host, uint16_t port, uint8_t TCPconnectID)
 {
     _TCPconnectID = TCPconnectID;
 
     // Write command: AT+QMTOPEN=<TCP_connectID>,<host_name>,<port>
 
-    sprintf(_buffer, "AT+QMTOPEN=%d,\"%s\",%d", _TCPconnectID, host, port);
+    if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QMTOPEN=%d,\"%s\",%d", _TCPconnectID, host, port)))
+    {
+        return false;
+    }
 
     // Reply is:
     // OK
@@ -511,24 +943,27 @@ bool QuectelBC660::openMQTT(const char* host, uint16_t port, uint8_t TCPconnectI
             if (token)
             {
                 char* ptr;
-                uint8_t stat;
+                int16_t stat;
                 stat =  strtol(token, &ptr, 10);
 
                 if (stat == 0)
                 {
                     if(_debug != false)
                     {
-                    Serial.print("\nMQTT open succeeded, Stat: ");
-                    Serial.println(stat);
+                    _debugStream->print("\nMQTT open succeeded, Stat: ");
+                    _debugStream->println(stat);
                     }
                     return true;
                 }
                 else
                 {
+                    // Stat: -1 = failed to open network, 1 = wrong parameter, 2 = identifier occupied,
+                    // 3 = failed to activate PDP, 4 = failed to parse domain name, 5 = network disconnection
+                    setStatResult(stat, stat == -1 || stat == 3 || stat == 5);
                     if(_debug != false)
                     {
-                    Serial.print("\nMQTT open failed, Stat: ");
-                    Serial.println(stat);
+                    _debugStream->print("\nMQTT open failed, Stat: ");
+                    _debugStream->println(stat);
                     }
                     return false;
                 }
@@ -537,7 +972,10 @@ bool QuectelBC660::openMQTT(const char* host, uint16_t port, uint8_t TCPconnectI
     }
     if(_debug != false)
     {
-        Serial.print("\nMQTT open failed, different error occured!");
+        _debugStream->print("\nMQTT open failed, cause: ");
+        _debugStream->print(_lastResult.cause);
+        _debugStream->print(", error code: ");
+        _debugStream->println(_lastResult.errorCode);
     }
     return false;
 }
@@ -546,18 +984,18 @@ bool QuectelBC660::closeMQTT()
 {
     // Write command: AT+QMTCLOSE=<TCP_connectID>   
 
-    sprintf(_buffer, "AT+QMTCLOSE=%d", _TCPconnectID);
+    snprintf(_buffer, sizeof(_buffer), "AT+QMTCLOSE=%d", _TCPconnectID);
     if (!sendAndCheckReply(_buffer, _OK, 5000))
     {
         if(_debug != false)
         {
-            Serial.println("\nFailed to close MQTT connection!");
+            _debugStream->println("\nFailed to close MQTT connection!");
         }
         return false;
     }
     if(_debug != false)
         {
-            Serial.println("\nMQTT connection closed successfully!");
+            _debugStream->println("\nMQTT connection closed successfully!");
         }
     return true;
 }
@@ -566,294 +1004,2792 @@ bool QuectelBC660::connectMQTT(const char* clientID)
 {
     // Write command: AT+QMTCONN=<TCP_connectID>,<clientID>
 
-    sprintf(_buffer, "AT+QMTCONN=%d,\"%s\"", _TCPconnectID, clientID);
+    if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QMTCONN=%d,\"%s\"", _TCPconnectID, clientID)))
+    {
+        return false;
+    }
 
     // Reply is:
     // OK
     // 
-    // +QMTCONN: 0,0,0
+    // +QMTCONN: <TCP_connectID>,<result>[,<ret_code>]
+    // result: 0 = packet sent successfully and ACK received, 1 = retransmission, 2 = failed
+    // ret_code: 0 = connection accepted, 1-5 = refused (protocol, identifier, server, credentials, authorization)
     wakeUp();
     if(sendAndWaitForReply(_buffer, 5000, 3))
     {
-        return true;
+        char * token = strstr(_buffer, "+QMTCONN:");
+        int id, result, retCode = 0;
+        if (token && sscanf(token, "+QMTCONN: %d,%d,%d", &id, &result, &retCode) >= 2)
+        {
+            if (result == 0 && retCode == 0)
+            {
+                touchMQTTSession();
+                return true;
+            }
+            // Refused connections are permanent failures except 3 (server unavailable)
+            setStatResult(retCode != 0 ? retCode : result, retCode == 0 || retCode == 3);
+            if(_debug != false)
+            {
+                _debugStream->print("\nMQTT connect failed, result: ");
+                _debugStream->print(result);
+                _debugStream->print(", return code: ");
+                _debugStream->println(retCode);
+            }
+        }
     }
     return false;
 }
 
-bool QuectelBC660::publishMQTT(const char* msg, uint16_t msgLen, const char* topic, uint16_t msgID, uint8_t QoS, uint8_t retain)
+bool QuectelBC660::setMQTTKeepAlive(uint16_t keepAlive, uint8_t TCPconnectID)
 {
-    // AT+QMTPUB=<TCP_connectID>,<msgID>,<QoS>,<retain>,<topic>,<msg_len>,<msg>
-
-    sprintf(_buffer, "AT+QMTPUB=%d,%d,%d,%d,\"%s\",%d,\"%s\"", _TCPconnectID, msgID, QoS, retain, topic, msgLen, msg);
+    // AT+QMTCFG="keepalive",<TCP_connectID>,<keep_alive_time>
+    // keep_alive_time: 0-3600 s, 0 disables keepalive. To keep the connection over PSM it has to be
+    // longer than the PSM interval, otherwise the broker drops the client while the module sleeps.
+    snprintf(_buffer, sizeof(_buffer), "AT+QMTCFG=\"keepalive\",%d,%d", TCPconnectID, keepAlive);
+    wakeUp();
+    return sendAndCheckReply(_buffer, _OK, 1000);
+}
 
-    // Reply is:
-    // OK
-    // 
-    // +QMTPUB: 0,0,0
+bool QuectelBC660::setMQTTSession(bool cleanSession, uint32_t sessionExpiry, uint8_t TCPconnectID)
+{
+    // AT+QMTCFG="session",<TCP_connectID>,<clean_session>
+    // With clean_session 0 the broker keeps subscriptions and queued QoS 1/2 messages between
+    // connections. MQTT 3.1.1 has no session expiry on the wire, sessionExpiry [s] is the broker's
+    // configured expiry and is used to tell whether a persistent session survived (0 = never expires).
+    snprintf(_buffer, sizeof(_buffer), "AT+QMTCFG=\"session\",%d,%d", TCPconnectID, cleanSession);
     wakeUp();
-    if(sendAndWaitForReply(_buffer, 5000, 3))
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
     {
-        return true;
+        return false;
     }
-    return false;
+    _mqttCleanSession = cleanSession;
+    _mqttSessionExpiry = sessionExpiry;
+    return true;
 }
 
-// UDP functions
-bool QuectelBC660::openUDP(const char* host, uint16_t port, uint8_t TCPconnectID)
+bool QuectelBC660::setMQTTWill(const char* topic, const char* msg, uint8_t QoS, uint8_t retain, uint8_t TCPconnectID)
 {
-    _TCPconnectID = TCPconnectID;
-    strcpy(_host, host);
-    _port = port;
-    sprintf(_buffer, "AT+QIOPEN=0,%d,\"UDP\",\"%s\",%d", _TCPconnectID, _host, _port);
-    wakeUp();
-    if(sendAndWaitForReply(_buffer, 60000, 3))
+    // AT+QMTCFG="will",<TCP_connectID>,<will_fg>[,<will_qos>,<will_retain>,<will_topic>,<will_msg>]
+    // topic nullptr removes the will
+    if (topic == nullptr)
     {
-        char * token = strtok(_buffer, ",");
-        if (token)
+        snprintf(_buffer, sizeof(_buffer), "AT+QMTCFG=\"will\",%d,0", TCPconnectID);
+    }
+    else
+    {
+        if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QMTCFG=\"will\",%d,1,%d,%d,\"%s\",\"%s\"", TCPconnectID, QoS, retain, topic, msg)))
         {
-            token = strtok(nullptr, "\n");
-            if (token)
-            {
-                char* ptr;
-                uint8_t stat;
-                stat =  strtol(token, &ptr, 10);
-
-                if (stat == 0)
-                {
-                    if(_debug != false)
-                    {
-                    Serial.print("\nUDP client connected successfully, Stat: ");
-                    Serial.println(stat);
-                    }
-                    return true;
-                }
-                else
-                {
-                    if(_debug != false)
-                    {
-                    Serial.print("\nUDP client connection failed, Stat: ");
-                    Serial.println(stat);
-                    }
-                    return false;
-                }
-            }
+            return false;
         }
     }
-    if(_debug != false)
-    {
-        Serial.print("\nUDP client connection failed, different error occured!");
+    wakeUp();
+    return sendAndCheckReply(_buffer, _OK, 1000);
+}
+
+void QuectelBC660::setMQTTSessionStore(mqttSessionStruct* session)
+{
+    // Session record kept by the application, e.g. in RTC memory, so it survives MCU deep sleep
+    _mqttSession = session;
+}
+
+bool QuectelBC660::ensureMQTTConnected(const char* host, uint16_t port, const char* clientID, uint8_t TCPconnectID)
+{
+    // Brings the MQTT connection up with the least number of exchanges:
+    // connection still up after PSM -> nothing to do, only network opened -> AT+QMTCONN,
+    // otherwise AT+QMTOPEN and AT+QMTCONN. While the module is connecting or disconnecting the state is
+    // polled until it settles, AT+QMTOPEN would fail with the identifier occupied.
+    _TCPconnectID = TCPconnectID;
+    uint8_t state = getMQTTState();
+    uint32_t start = millis();
+    uint32_t timeout = (uint32_t)_mqttPacketTimeout * (_mqttRetryTimes + 1) * 1000;
+    while (state == MQTT_STATE_CONNECTING || state == MQTT_STATE_DISCONNECTING)
+    {
+        if (millis() - start >= timeout)
+        {
+            _lastResult = {RESULT_TIMEOUT, -1, -1, true, false};
+            return false;
+        }
+        delay(ONE_SEC);
+        loop();
+        state = getMQTTState();
+    }
+
+    // Persistent broker session is valid if it was used within the session expiry
+    time_t now = _clockSynced ? getEpoch() : 0;
+    _mqttSessionResumed = !_mqttCleanSession && _mqttSession->lastActivity != 0 &&
+                          (_mqttSessionExpiry == 0 || now == 0 || (uint32_t)(now - _mqttSession->lastActivity) < _mqttSessionExpiry);
+
+    if (state == MQTT_STATE_CONNECTED)
+    {
+        if(_debug != false)
+        {
+            _debugStream->println("\nMQTT connection survived, reusing it");
+        }
+        _mqttSession->reused++;
+        _mqttSessionResumed = true;
+        touchMQTTSession();
+        return true;
+    }
+    if (state != MQTT_STATE_INITIALIZING)
+    {
+        if (!openMQTT(host, port, TCPconnectID))
+        {
+            return false;
+        }
+        _mqttSession->reopened++;
+    }
+    else
+    {
+        _mqttSession->reconnected++;
+    }
+    return connectMQTT(clientID);
+}
+
+uint8_t QuectelBC660::getMQTTState()
+{
+    // Reply is:
+    // +QMTCONN: <TCP_connectID>,<state>
+    //
+    // OK
+    // state: 1 = initializing (network opened), 2 = connecting, 3 = connected, 4 = disconnecting
+    // No +QMTCONN line for the connection means network is not opened (state 0)
+    wakeUp();
+    if (sendAndWaitFor("AT+QMTCONN?", _OK, 1000))
+    {
+        char * token = _buffer;
+        while ((token = strstr(token, "+QMTCONN:")) != nullptr)
+        {
+            int id, state;
+            if (sscanf(token, "+QMTCONN: %d,%d", &id, &state) == 2 && id == _TCPconnectID)
+            {
+                return state;
+            }
+            token += 9;
+        }
+    }
+    return MQTT_STATE_CLOSED;
+}
+
+bool QuectelBC660::isMQTTSessionResumed()
+{
+    // True when the last ensureMQTTConnected() kept the connection or resumed a persistent broker
+    // session, subscriptions do not have to be renewed
+    return _mqttSessionResumed;
+}
+
+void QuectelBC660::touchMQTTSession()
+{
+    if (_clockSynced)
+    {
+        _mqttSession->lastActivity = getEpoch();
+    }
+}
+
+bool QuectelBC660::publishMQTT(const char* msg, uint16_t msgLen, const char* topic, uint16_t msgID, uint8_t QoS, uint8_t retain, bool compressed, uint8_t RAI)
+{
+    // AT+QMTPUB=<TCP_connectID>,<msgID>,<QoS>,<retain>,<topic>,<msg_len>,<msg>
+    // For QoS > 0 use RAI_ONE_REPLY, RAI_NO_REPLY would release the connection before PUBACK arrives
+    // msgID 0 with QoS > 0 allocates message ID automatically, the ID of a message still in flight from
+    // publishMQTTAsync() is rejected
+
+    // Reply is:
+    // OK
+    // 
+    // +QMTPUB: <TCP_connectID>,<msgID>,<result>[,<value>]
+    wakeUp();
+    if (RAI != RAI_NONE && !setRAI(RAI))
+    {
+        return false;
+    }
+    bool published = sendMQTTPublish(msg, msgLen, topic, msgID, QoS, retain, compressed);
+    clearRAI(RAI);
+    return published;
+}
+
+bool QuectelBC660::sendMQTTPublish(const char* msg, uint16_t msgLen, const char* topic, uint16_t msgID, uint8_t QoS, uint8_t retain, bool compressed)
+{
+    if (QoS > 0 && msgID == 0)
+    {
+        msgID = nextMQTTMessageID();
+    }
+    else if (QoS > 0 && mqttMessageIDInFlight(msgID))
+    {
+        // Its +QMTPUB URC would complete the queued message instead
+        _lastResult = {RESULT_ERROR, -1, -1, true, false};
+        if(_debug != false)
+        {
+            _debugStream->println("\nMQTT message ID is in flight");
+        }
+        return false;
+    }
+#if !QUECTEL_BC660_COMPRESSION
+    if (compressed)
+    {
+        // Compression is left out of the build
+        _lastResult = {RESULT_ERROR, -1, -1, false, false};
+        return false;
+    }
+#endif
+    if (!setMQTTDataFormat(compressed))
+    {
+        return false;
+    }
+    bool replied;
+#if QUECTEL_BC660_COMPRESSION
+    if (compressed)
+    {
+        // Binary frame can not be passed as text, it is sent as hex string
+        uint8_t frame[COMPRESSION_BUFFER_SIZE];
+        uint16_t frameLen = compress((const uint8_t*)msg, msgLen, frame, sizeof(frame));
+        if (frameLen == 0)
+        {
+            if ((size_t)msgLen + 1 > sizeof(frame))
+            {
+                return false;
+            }
+            frame[0] = COMPRESSION_STORED;
+            memcpy(frame + 1, msg, msgLen);
+            frameLen = msgLen + 1;
+        }
+        if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QMTPUB=%d,%d,%d,%d,\"%s\",%d,\"", _TCPconnectID, msgID, QoS, retain, topic, frameLen)))
+        {
+            return false;
+        }
+        replied = sendHexAndWaitForReply(_buffer, frame, frameLen, "\"", 5000, 3);
+    }
+    else
+#endif
+    {
+        if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QMTPUB=%d,%d,%d,%d,\"%s\",%d,\"%s\"", _TCPconnectID, msgID, QoS, retain, topic, msgLen, msg)))
+        {
+            return false;
+        }
+        replied = sendAndWaitForReply(_buffer, 5000, 3);
+    }
+    if (!replied)
+    {
+        return false;
+    }
+
+    // <result>: 0 = sent successfully (PUBACK/PUBCOMP received for QoS > 0)
+    //           1 = packet is being retransmitted, <value> is number of retransmissions
+    //           2 = failed to send packet
+    uint32_t start = millis();
+    uint32_t timeout = (uint32_t)_mqttPacketTimeout * (_mqttRetryTimes + 1) * 1000;
+    while (true)
+    {
+        // Other messages' URCs may be mixed into the reply, look for the one with our message ID
+        char * token = _buffer;
+        uint8_t id, result;
+        uint16_t replyID = 0xFFFF;
+        while ((token = strstr(token, "+QMTPUB:")) != nullptr)
+        {
+            if (sscanf(token, "+QMTPUB: %hhu,%hu,%hhu", &id, &replyID, &result) == 3 && replyID == msgID)
+            {
+                break;
+            }
+            token += 8;
+        }
+        if (token)
+        {
+            if (result != 1)
+            {
+                if (result != 0)
+                {
+                    setStatResult(result, true);
+                }
+                if(_debug != false && result != 0)
+                {
+                    _debugStream->print("\nMQTT publish failed, result: ");
+                    _debugStream->println(result);
+                }
+                if (result == 0)
+                {
+                    touchMQTTSession();
+                }
+                return result == 0;
+            }
+            mqttStats.retransmissions++;
+        }
+        if (millis() - start >= timeout || !readReply(timeout - (millis() - start), 1))
+        {
+            return false;
+        }
+    }
+}
+
+bool QuectelBC660::publishMQTTAsync(const char* msg, uint16_t msgLen, const char* topic, uint8_t QoS, uint8_t retain, uint16_t* msgID)
+{
+    // Publish without waiting for PUBACK/PUBCOMP, message ID is allocated automatically.
+    // Completion is reported by +QMTPUB URC (processed by loop()) to the publish callback.
+    // Up to MQTT_INFLIGHT_WINDOW QoS 1/2 messages can be in flight, when the window is full
+    // this function waits for a free slot.
+    uint16_t id = QoS > 0 ? nextMQTTMessageID() : 0;
+    int8_t slot = -1;
+    if (QoS > 0)
+    {
+        uint32_t start = millis();
+        uint32_t timeout = (uint32_t)_mqttPacketTimeout * (_mqttRetryTimes + 1) * 1000;
+        while ((slot = freeMQTTSlot()) < 0)
+        {
+            if (millis() - start >= timeout)
+            {
+                return false;
+            }
+            delay(1);
+            loop();
+        }
+    }
+    wakeUp();
+    if (!setMQTTDataFormat(false))
+    {
+        return false;
+    }
+    // Slot is taken before sending, a fast +QMTPUB URC may arrive together with OK
+    if (slot >= 0)
+    {
+        _mqttInFlight[slot] = id;
+        if (_sequencePublishStep != 0xFF)
+        {
+            _sequenceMsgIDs[slot] = id;
+            _sequenceMsgSteps[slot] = _sequencePublishStep;
+        }
+    }
+    bool fits = commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QMTPUB=%d,%d,%d,%d,\"%s\",%d,\"%s\"", _TCPconnectID, id, QoS, retain, topic, msgLen, msg));
+    if (!fits || !sendAndWaitFor(_buffer, _OK, 5000))
+    {
+        if (slot >= 0)
+        {
+            _mqttInFlight[slot] = 0;
+            _sequenceMsgIDs[slot] = 0;
+        }
+        return false;
+    }
+    mqttStats.published++;
+    if (msgID)
+    {
+        *msgID = id;
+    }
+    return true;
+}
+
+void QuectelBC660::setMQTTPublishCallback(void (*callback)(uint16_t msgID, uint8_t result))
+{
+    // Callback is called from loop() (or any command) when a queued QoS 1/2 message completed,
+    // result 0 = delivered, 2 = failed after all retransmissions
+    _mqttPublishCallback = callback;
+}
+
+bool QuectelBC660::setMQTTRetransmission(uint8_t packetTimeout, uint8_t retryTimes)
+{
+    // AT+QMTCFG="timeout",<TCP_connectID>,<pkt_timeout>,<retry_times>,<timeout_notice>
+    // Module retransmits unacknowledged packets after pkt_timeout seconds, up to retry_times
+    snprintf(_buffer, sizeof(_buffer), "AT+QMTCFG=\"timeout\",%d,%d,%d,1", _TCPconnectID, packetTimeout, retryTimes);
+    wakeUp();
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        return false;
+    }
+    _mqttPacketTimeout = packetTimeout;
+    _mqttRetryTimes = retryTimes;
+    return true;
+}
+
+uint8_t QuectelBC660::getMQTTInFlight()
+{
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        if (_mqttInFlight[i] != 0)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+uint8_t QuectelBC660::waitForMQTTPublished(uint32_t timeout)
+{
+    // Returns number of messages still in flight after timeout (0 = all completed)
+    uint32_t start = millis();
+    while (getMQTTInFlight() > 0 && millis() - start < timeout)
+    {
+        loop();
+        delay(1);
+    }
+    return getMQTTInFlight();
+}
+
+uint16_t QuectelBC660::nextMQTTMessageID()
+{
+    // Message IDs 1-65535, IDs still in flight are skipped
+    while (true)
+    {
+        if (++_mqttNextMsgID == 0)
+        {
+            _mqttNextMsgID = 1;
+        }
+        if (!mqttMessageIDInFlight(_mqttNextMsgID))
+        {
+            return _mqttNextMsgID;
+        }
+    }
+}
+
+bool QuectelBC660::mqttMessageIDInFlight(uint16_t msgID)
+{
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        if (_mqttInFlight[i] == msgID)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int8_t QuectelBC660::freeMQTTSlot()
+{
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        if (_mqttInFlight[i] == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool QuectelBC660::setMQTTDataFormat(bool hex)
+{
+    // AT+QMTCFG="dataformat",<TCP_connectID>,<send_mode>,<recv_mode>, only sent when the format changes
+    if (hex == _mqttHexMode)
+    {
+        return true;
+    }
+    snprintf(_buffer, sizeof(_buffer), "AT+QMTCFG=\"dataformat\",%d,%d,0", _TCPconnectID, hex);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        return false;
+    }
+    _mqttHexMode = hex;
+    return true;
+}
+
+#endif
+
+// UDP functions
+bool QuectelBC660::openUDP(const char* host, uint16_t port, uint8_t TCPconnectID)
+{
+    // Same DNS cache handling as openMQTT(). UDP open does not reach the host, so a stale address
+    // is only detected when the application calls invalidateHost() (e.g. after missing replies).
+#if QUECTEL_BC660_DNS_CACHE
+    bool cached = false;
+    const char* address = lookupHost(host, &cached);
+    if (openUDPSocket(address, port, TCPconnectID))
+    {
+        return true;
+    }
+    if (!cached)
+    {
+        return false;
+    }
+    address = reresolveHost(host);
+    return address != nullptr && openUDPSocket(address, port, TCPconnectID);
+#else
+    return openUDPSocket(host, port, TCPconnectID);
+#endif
+}
+
+bool QuectelBC660::openUDPSocket(const char* host, uint16_t port, uint8_t TCPconnectID)
+{
+    _TCPconnectID = TCPconnectID;
+    wakeUp();
+    // Received data is read back as hex string (AT+QIRD), so binary datagrams survive the text based reply parsing.
+    // Inline send mode passes the data as hex string too.
+    snprintf(_buffer, sizeof(_buffer), "AT+QICFG=\"dataformat\",%d,1", _udpSendMode == UDP_SEND_INLINE);
+    sendAndCheckReply(_buffer, _OK, 1000);
+    if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QIOPEN=0,%d,\"UDP\",\"%s\",%d", _TCPconnectID, host, port)))
+    {
+        return false;
+    }
+    if(sendAndWaitForReply(_buffer, 60000, 3))
+    {
+        char * token = strtok(_buffer, ",");
+        if (token)
+        {
+            token = strtok(nullptr, "\n");
+            if (token)
+            {
+                char* ptr;
+                int16_t stat;
+                stat =  strtol(token, &ptr, 10);
+
+                if (stat == 0)
+                {
+                    if(_debug != false)
+                    {
+                    _debugStream->print("\nUDP client connected successfully, Stat: ");
+                    _debugStream->println(stat);
+                    }
+                    return true;
+                }
+                else
+                {
+                    // Stat is an error code of the same range as +CME ERROR (550-574)
+                    setStatResult(stat, isTransientError(stat));
+                    if(_debug != false)
+                    {
+                    _debugStream->print("\nUDP client connection failed, Stat: ");
+                    _debugStream->println(stat);
+                    }
+                    return false;
+                }
+            }
+        }
+    }
+    if(_debug != false)
+    {
+        _debugStream->print("\nUDP client connection failed, cause: ");
+        _debugStream->print(_lastResult.cause);
+        _debugStream->print(", error code: ");
+        _debugStream->println(_lastResult.errorCode);
+    }
+    return false;
+}
+
+bool QuectelBC660::closeUDP()
+{
+    snprintf(_buffer, sizeof(_buffer), "AT+QICLOSE=%d", _TCPconnectID);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        if(_debug != false)
+        {
+            _debugStream->println("\nFailed to close UDP connection!");
+        }
+        return false;
+    }
+    if(_debug != false)
+        {
+            _debugStream->println("\nUDP connection closed successfully!");
+        }
+    return true;
+}
+
+bool QuectelBC660::sendDataUDP(const char* msg, uint16_t msgLen, uint8_t RAI)
+{
+    return sendUDP(msg, msgLen, RAI, true);
+}
+
+bool QuectelBC660::queueDataUDP(const char* msg, uint16_t msgLen, uint8_t RAI)
+{
+    // Pipelined send (inline send mode only): the command is written without waiting for SEND OK,
+    // up to UDP_PIPELINE_DEPTH datagrams are in flight, completions are collected by waitForUDPSent()
+    if (_udpSendMode != UDP_SEND_INLINE)
+    {
+        return sendUDP(msg, msgLen, RAI, true);
+    }
+    return sendUDP(msg, msgLen, RAI, false);
+}
+
+uint8_t QuectelBC660::waitForUDPSent(uint32_t timeout)
+{
+    // Returns number of queued datagrams that failed or did not complete before timeout,
+    // including failures collected since the last call
+    collectUDPSent(timeout);
+    uint8_t failed = _udpSendFailed;
+    if(_debug != false && failed > 0)
+    {
+        _debugStream->print("\nQueued UDP sends failed: ");
+        _debugStream->println(failed);
+    }
+    _udpSendFailed = 0;
+    return failed;
+}
+
+void QuectelBC660::collectUDPSent(uint32_t timeout)
+{
+    // Sends without completion before timeout are counted as failed
+    uint32_t start = millis();
+    while (_udpInFlight > 0 && millis() - start < timeout)
+    {
+        loop();
+        if (_udpInFlight > 0)
+        {
+            delay(1);
+        }
+    }
+    _udpSendFailed += _udpInFlight;
+    _udpInFlight = 0;
+}
+
+uint8_t QuectelBC660::getUDPInFlight()
+{
+    // Queued datagrams without SEND OK yet, call loop() to collect completions
+    loop();
+    return _udpInFlight;
+}
+
+void QuectelBC660::setUDPSendMode(uint8_t mode)
+{
+    // UDP_SEND_PROMPT: AT+QISEND=<id>,<len>, wait for '>' and write the data (two exchanges)
+    // UDP_SEND_INLINE: AT+QISEND=<id>,<len>,<hex data>[,<RAI>] (single exchange, pipelinable)
+    // Data format of the socket depends on the mode, set it before openUDP()
+    _udpSendMode = mode;
+}
+
+bool QuectelBC660::sendUDP(const char* msg, uint16_t msgLen, uint8_t RAI, bool wait)
+{
+#if QUECTEL_BC660_COMPRESSION
+    if (_udpCompression)
+    {
+        uint8_t frame[COMPRESSION_BUFFER_SIZE];
+        uint16_t frameLen = compress((const uint8_t*)msg, msgLen, frame, sizeof(frame));
+        if (frameLen > 0)
+        {
+            return writeUDP(0, (const uint8_t*)frame, frameLen, RAI, wait);
+        }
+        // Not compressible (or too big for the buffer), send as stored frame
+        return writeUDP(COMPRESSION_STORED, (const uint8_t*)msg, msgLen, RAI, wait);
+    }
+#endif
+    return writeUDP(0, (const uint8_t*)msg, msgLen, RAI, wait);
+}
+
+#if QUECTEL_BC660_COMPRESSION
+void QuectelBC660::setUDPCompression(bool enable)
+{
+    // All datagrams sent with sendDataUDP() on this socket are framed and compressed (see compress())
+    _udpCompression = enable;
+}
+#endif
+
+bool QuectelBC660::setRAI(uint8_t RAI)
+{
+    // AT+QNBIOTRAI=<RAI>, the indication is sent with the following uplink data so the module can
+    // enter PSM as soon as the uplink (and the expected reply) completed.
+    // Setting is module-wide and kept by the module, every send that sets it clears it with clearRAI().
+    snprintf(_buffer, sizeof(_buffer), "AT+QNBIOTRAI=%d", RAI);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        if(_debug != false)
+        {
+            _debugStream->println("\nFailed to set release assistance indication!");
+        }
+        return false;
+    }
+    return true;
+}
+
+void QuectelBC660::clearRAI(uint8_t RAI)
+{
+    // Later uplinks (other publishes, CONNACK and PUBACK exchanges) must not carry the hint of
+    // the last send, result of the send is kept
+    if (RAI == RAI_NONE)
+    {
+        return;
+    }
+    resultStruct result = _lastResult;
+    setRAI(RAI_NONE);
+    _lastResult = result;
+}
+
+bool QuectelBC660::writeUDP(uint8_t header, const uint8_t* data, uint16_t dataLen, uint8_t RAI, bool wait)
+{
+    // Optional header byte is written in front of the data (used for stored compression frames)
+    uint16_t msgLen = dataLen + (header != 0);
+    if (_udpSendMode == UDP_SEND_INLINE)
+    {
+        // AT+QISEND=<connectID>,<send_length>,<data>[,<RAI>]
+        // Reply is:
+        // OK
+        //
+        // SEND OK
+        char suffix[5] = "";
+        if (RAI != RAI_NONE)
+        {
+            sprintf(suffix, ",%d", RAI);
+        }
+        snprintf(_buffer, sizeof(_buffer), "AT+QISEND=%d,%d,", _TCPconnectID, msgLen);
+        if (header != 0)
+        {
+            snprintf(_buffer + strlen(_buffer), sizeof(_buffer) - strlen(_buffer), "%02X", header);
+        }
+        if (wait)
+        {
+            if (sendHexAndWaitForReply(_buffer, data, dataLen, suffix, 5000, 3) && strstr(_buffer, "SEND OK"))
+            {
+                return true;
+            }
+            if(_debug != false)
+            {
+                _debugStream->print("\nSend failed");
+            }
+            return false;
+        }
+        // Pipelined: make room in the window, then wait only for OK of the command, SEND OK or
+        // SEND FAIL is collected later by checkURC()
+        loop();
+        uint32_t start = millis();
+        while (_udpInFlight >= UDP_PIPELINE_DEPTH)
+        {
+            if (millis() - start >= 5000)
+            {
+                _udpSendFailed++;
+                _udpInFlight--;
+                break;
+            }
+            delay(1);
+            loop();
+        }
+        // The command gets its own 5 s for OK, however long the window wait took
+        start = millis();
+        _udpQueueing = true;
+        bool accepted = sendHexAndWaitForReply(_buffer, data, dataLen, suffix, 5000, 1);
+        _udpQueueing = false;
+        // Completions of earlier sends and other URCs may arrive before OK, they are processed by readReply()
+        while (accepted && strncmp(_buffer, _OK, 2) != 0 && millis() - start < 5000)
+        {
+            accepted = readReply(5000 - (millis() - start), 1);
+        }
+        if (!accepted || strncmp(_buffer, _OK, 2) != 0)
+        {
+            if(_debug != false)
+            {
+                _debugStream->print("\nSend failed");
+            }
+            return false;
+        }
+        _udpInFlight++;
+        return true;
+    }
+
+    if (RAI != RAI_NONE && !setRAI(RAI))
+    {
+        return false;
+    }
+    bool sent = false;
+    snprintf(_buffer, sizeof(_buffer), "AT+QISEND=%d,%d", _TCPconnectID, msgLen);
+    if (sendAndWaitFor(_buffer, ">", 5000))
+    {
+        if(_debug != false)
+        {
+            _debugStream->print("\n --> msg: ");
+            _debugStream->write(data, dataLen);
+            _debugStream->print(" , size: ");
+            _debugStream->println(msgLen);
+        }
+        if (header != 0)
+        {
+            _uart->write(header);
+        }
+        _uart->write(data, dataLen);
+        sent = readReply(5000, 3) && strstr(_buffer, "SEND OK");
+    }
+    else if(_debug != false)
+    {
+        _debugStream->print("\nError occured before data send command");
+    }
+    clearRAI(RAI);
+    if(_debug != false && !sent)
+    {
+        _debugStream->print("\nSend failed");
+    }
+    return sent;
+}
+
+#if QUECTEL_BC660_COMPRESSION
+// Payload compression
+// Byte aligned LZSS, the whole frame is decodable without knowing anything but this format:
+//   'Z', <original length MSB>, <original length LSB>, then groups of one control byte followed by
+//   up to 8 items. Control bit i (LSB first) set = item is one literal byte, clear = item is a match
+//   of two bytes: <distance-1 bits 11..4>, <distance-1 bits 3..0><length-3>, copied from the already
+//   decoded output (distance 1..4096, length 3..18).
+//   'R', <original data> is a stored frame, used when the data does not compress.
+// Match search uses a small hash table on the stack, no allocation and no window buffer is needed
+// because the message itself is the window.
+#define COMPRESSION_HASH_BITS 6
+#define COMPRESSION_MIN_MATCH 3
+#define COMPRESSION_MAX_MATCH 18
+#define COMPRESSION_MAX_DISTANCE 4096
+
+uint16_t QuectelBC660::compress(const uint8_t* in, uint16_t inLen, uint8_t* out, uint16_t outSize)
+{
+    // Returns frame length or 0 if the frame would not be smaller than the input or does not fit into out
+    uint32_t start = micros();
+    uint16_t head[1 << COMPRESSION_HASH_BITS];
+    memset(head, 0xFF, sizeof(head));
+    uint16_t limit = min(outSize, inLen);
+    uint16_t pos = 0;
+    uint16_t len = 3;
+    bool fits = limit > 3;
+    while (fits && pos < inLen)
+    {
+        if (len >= limit)
+        {
+            fits = false;
+            break;
+        }
+        uint16_t control = len++;
+        out[control] = 0;
+        for (uint8_t bit = 0; bit < 8 && pos < inLen; bit++)
+        {
+            if (len + 2 > limit)
+            {
+                fits = false;
+                break;
+            }
+            uint16_t matchLen = 0;
+            uint16_t distance = 0;
+            if (pos + COMPRESSION_MIN_MATCH <= inLen)
+            {
+                uint8_t hash = ((in[pos] << 4) ^ (in[pos + 1] << 2) ^ in[pos + 2]) & ((1 << COMPRESSION_HASH_BITS) - 1);
+                uint16_t candidate = head[hash];
+                head[hash] = pos;
+                if (candidate != 0xFFFF && pos - candidate <= COMPRESSION_MAX_DISTANCE)
+                {
+                    while (matchLen < COMPRESSION_MAX_MATCH && pos + matchLen < inLen && in[candidate + matchLen] == in[pos + matchLen])
+                    {
+                        matchLen++;
+                    }
+                    distance = pos - candidate;
+                }
+            }
+            if (matchLen >= COMPRESSION_MIN_MATCH)
+            {
+                out[len++] = (distance - 1) >> 4;
+                out[len++] = ((distance - 1) << 4) | (matchLen - COMPRESSION_MIN_MATCH);
+                pos += matchLen;
+            }
+            else
+            {
+                out[control] |= 1 << bit;
+                out[len++] = in[pos++];
+            }
+        }
+    }
+    uint32_t cpuTime = micros() - start;
+    compressionStats.cpuTime += cpuTime;
+    compressionStats.inputBytes += inLen;
+    compressionStats.messages++;
+    if (!fits)
+    {
+        compressionStats.outputBytes += inLen + 1;
+        return 0;
+    }
+    out[0] = COMPRESSION_COMPRESSED;
+    out[1] = inLen >> 8;
+    out[2] = inLen;
+    compressionStats.outputBytes += len;
+    if(_debug != false)
+    {
+        _debugStream->print("\nCompressed ");
+        _debugStream->print(inLen);
+        _debugStream->print(" B to ");
+        _debugStream->print(len);
+        _debugStream->print(" B in [us]: ");
+        _debugStream->println(cpuTime);
+    }
+    return len;
+}
+
+int16_t QuectelBC660::decompress(const uint8_t* in, uint16_t inLen, uint8_t* out, uint16_t outSize)
+{
+    // Returns decoded length or -1 on malformed frame / too small output buffer
+    if (inLen < 1)
+    {
+        return -1;
+    }
+    if (in[0] == COMPRESSION_STORED)
+    {
+        if (inLen - 1 > outSize)
+        {
+            return -1;
+        }
+        memcpy(out, in + 1, inLen - 1);
+        return inLen - 1;
+    }
+    if (in[0] != COMPRESSION_COMPRESSED || inLen < 3)
+    {
+        return -1;
+    }
+    uint16_t outLen = (in[1] << 8) | in[2];
+    if (outLen > outSize)
+    {
+        return -1;
+    }
+    uint16_t pos = 3;
+    uint16_t written = 0;
+    while (written < outLen)
+    {
+        if (pos >= inLen)
+        {
+            return -1;
+        }
+        uint8_t control = in[pos++];
+        for (uint8_t bit = 0; bit < 8 && written < outLen; bit++)
+        {
+            if (control & (1 << bit))
+            {
+                if (pos >= inLen)
+                {
+                    return -1;
+                }
+                out[written++] = in[pos++];
+                continue;
+            }
+            if (pos + 2 > inLen)
+            {
+                return -1;
+            }
+            uint16_t distance = ((in[pos] << 4) | (in[pos + 1] >> 4)) + 1;
+            uint8_t matchLen = (in[pos + 1] & 0x0F) + COMPRESSION_MIN_MATCH;
+            pos += 2;
+            if (distance > written || written + matchLen > outLen)
+            {
+                return -1;
+            }
+            for (uint8_t i = 0; i < matchLen; i++, written++)
+            {
+                out[written] = out[written - distance];
+            }
+        }
+    }
+    return written;
+}
+
+float QuectelBC660::getCompressionRatio()
+{
+    // Output/input ratio over all compressed messages (0.25 = payloads shrank to a quarter)
+    if (compressionStats.inputBytes == 0)
+    {
+        return 1.0;
+    }
+    return (float)compressionStats.outputBytes / compressionStats.inputBytes;
+}
+#endif
+
+// Local time service
+bool QuectelBC660::syncClock()
+{
+    // Response: +CCLK: <time>
+    // Time: String type. The format is "YY/MM/DD,hh:mm:ss±zz", where characters indicate
+    // year (two last digits), month, day, hour, minute, second and time zone (indicates
+    // the difference, expressed in quarters of an hour, between the local time and GMT;
+    // the range is -96 to +96.) For instance, 6th of May 2014, 22:10:00 GMT+2 hours
+    // equals "14/05/06,22:10:00+08"
+
+	// Reply is:
+    // +CCLK: 20/11/03,06:25:06+32
+    // 
+    // OK
+    wakeUp();
+    if (sendAndWaitForReply("AT+CCLK?", 1000, 3))
+    {
+        char * token = strstr(_buffer, "+CCLK:");
+        time_t local;
+        int16_t timezone;
+        if (token && parseDateTime(token + 6, &local, &timezone))
+        {
+            setClock(local - (time_t)timezone * 15 * 60, timezone);
+            return true;
+        }
+    }
+    if(_debug != false)
+    {
+        _debugStream->println("\nClock sync failed!");
+    }
+    return false;
+}
+
+void QuectelBC660::setClockResyncInterval(uint32_t resyncInterval)
+{
+    _clockResyncInterval = resyncInterval;
+}
+
+bool QuectelBC660::setNetworkTimeURC(bool enable)
+{
+    // AT+CTZR=3 enables +CTZEU: <tz>,<dst>,[<utime>] URC on every network time zone change,
+    // <utime> is universal time in format "YYYY/MM/DD,hh:mm:ss"
+    wakeUp();
+    return sendAndCheckReply(enable ? "AT+CTZR=3" : "AT+CTZR=0", _OK, 1000);
+}
+
+time_t QuectelBC660::getEpoch()
+{
+    // UTC epoch extrapolated from the last sync using millis(), corrected for the measured drift
+    if (!_clockSynced || (millis() - _syncMillis) >= _clockResyncInterval)
+    {
+        if (!syncClock() && !_clockSynced)
+        {
+            return 0;
+        }
+    }
+    int64_t elapsed = (uint32_t)(millis() - _syncMillis);
+    elapsed += elapsed * _clockDrift / 1000000;
+    return _syncEpoch + (time_t)(elapsed / 1000);
+}
+
+time_t QuectelBC660::getLocalEpoch()
+{
+    time_t epoch = getEpoch();
+    if (epoch == 0)
+    {
+        return 0;
+    }
+    return epoch + (time_t)_timezone * 15 * 60;
+}
+
+int16_t QuectelBC660::getTimezone()
+{
+    // Quarters of an hour between the local time and GMT
+    return _timezone;
+}
+
+void QuectelBC660::setClock(time_t epoch, int16_t timezone)
+{
+    uint32_t now = millis();
+    if (_clockSynced)
+    {
+        // Compare the extrapolated time with the new sync and update the drift estimate. Syncs are
+        // only accurate to one second, so short intervals are not used for drift correction.
+        uint32_t elapsed = now - _syncMillis;
+        if (elapsed >= TEN_MIN)
+        {
+            int64_t corrected = (int64_t)elapsed + (int64_t)elapsed * _clockDrift / 1000000;
+            int64_t error = (int64_t)(epoch - _syncEpoch) * 1000 - corrected;
+            int32_t drift = _clockDrift + (int32_t)(error * 1000000 / (int64_t)elapsed);
+            _clockDrift = constrain(drift, -1000, 1000);
+        }
+    }
+    _syncEpoch = epoch;
+    _syncMillis = now;
+    _timezone = timezone;
+    _clockSynced = true;
+    if(_debug != false)
+    {
+        _debugStream->print("\nClock synced, epoch: ");
+        _debugStream->print((long)epoch);
+        _debugStream->print(", drift [ppm]: ");
+        _debugStream->println(_clockDrift);
+    }
+}
+
+bool QuectelBC660::parseDateTime(const char* str, time_t* epoch, int16_t* timezone)
+{
+    // Parses "YY/MM/DD,hh:mm:ss±zz" (+CCLK) or "YYYY/MM/DD,hh:mm:ss" (+CTZEU), quotes and leading spaces are skipped
+    while (*str == ' ' || *str == '"')
+    {
+        str++;
+    }
+    int year, month, day, hour, minute, second, consumed = 0;
+    if (sscanf(str, "%d/%d/%d,%d:%d:%d%n", &year, &month, &day, &hour, &minute, &second, &consumed) != 6)
+    {
+        return false;
+    }
+    if (year < 100)
+    {
+        year += 2000;
+    }
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+    {
+        return false;
+    }
+
+    // Days since 1970-01-01 of the civil date (proleptic Gregorian calendar), no mktime()/TZ dependency
+    year -= month <= 2;
+    int32_t era = year / 400;
+    int32_t yearOfEra = year - era * 400;
+    int32_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    int32_t days = era * 146097 + dayOfEra - 719468;
+    *epoch = (time_t)days * 86400 + hour * 3600 + minute * 60 + second;
+
+    const char* tz = str + consumed;
+    *timezone = 0;
+    if (*tz == '+' || *tz == '-')
+    {
+        *timezone = atoi(tz + 1);
+        if (*tz == '-')
+        {
+            *timezone = -*timezone;
+        }
+    }
+    return true;
+}
+
+int16_t QuectelBC660::receiveDataUDP(uint8_t* data, uint16_t maxLen, uint32_t timeout)
+{
+    // Returns number of bytes read, 0 if no datagram arrived before timeout, -1 on error
+    // Module reports incoming data with URC: +QIURC: "recv",<connectID>
+    // Data is then read with AT+QIRD=<connectID>,<read_length>, reply is:
+    // +QIRD: <actual_length>
+    // <hex data>
+    //
+    // OK
+    uint32_t start = millis();
+    uint16_t readLen = min((uint16_t)((sizeof(_buffer) - 24) / 2), maxLen);
+    while (true)
+    {
+        while (!_udpDataPending)
+        {
+            loop();
+            if (_udpDataPending)
+            {
+                break;
+            }
+            if (millis() - start >= timeout)
+            {
+                return 0;
+            }
+            delay(1);
+        }
+        _udpDataPending = false;
+        snprintf(_buffer, sizeof(_buffer), "AT+QIRD=%d,%d", _TCPconnectID, readLen);
+        if (!sendAndWaitFor(_buffer, _OK, 1000))
+        {
+            return -1;
+        }
+        char * token = strstr(_buffer, "+QIRD:");
+        if (!token)
+        {
+            return -1;
+        }
+        uint16_t len = strtol(token + 6, nullptr, 10);
+        if (len == 0)
+        {
+            // Buffer already drained, wait for next URC
+            continue;
+        }
+        char * hex = strchr(token, '\n');
+        if (!hex || len > readLen)
+        {
+            return -1;
+        }
+        hex++;
+        for (uint16_t i = 0; i < len; i++)
+        {
+            char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+            data[i] = strtol(byte, nullptr, 16);
+        }
+        // Several datagrams may be buffered behind a single URC
+        _udpDataPending = true;
+        if(_debug != false)
+        {
+            _debugStream->print("\n <-- UDP data, size: ");
+            _debugStream->println(len);
+        }
+        return len;
+    }
+}
+
+#if QUECTEL_BC660_LINK_HEALTH
+// Link health monitor
+// Every probe updates the statistics of its source: EWMA of the RTT (gain 1/8), RFC 3550 interarrival
+// jitter (gain 1/16) and loss over a sliding window of the last 32 probes. Serving cell readings are
+// taken after each probe run, so delivery latency can be compared with the radio conditions.
+bool QuectelBC660::pingHost(const char* host, uint8_t count, uint8_t timeout)
+{
+    // Write command: AT+QPING=<contextID>,<host>[,<timeout>[,<pingnum>]]
+    // Reply is:
+    // OK
+    //
+    // +QPING: <result>[,<IP_address>,<bytes>,<time>,<ttl>]        for each ping
+    //
+    // +QPING: <finresult>[,<sent>,<rcvd>,<lost>,<min>,<max>,<avg>] when done
+    // Returns true when at least one reply arrived
+    const char* address = host;
+#if QUECTEL_BC660_DNS_CACHE
+    if (_dnsCache)
+    {
+        bool cached;
+        address = lookupHost(host, &cached);
+    }
+#endif
+    wakeUp();
+    if (!commandFits(snprintf(_buffer, sizeof(_buffer), "AT+QPING=0,\"%s\",%d,%d", address, timeout, count)))
+    {
+        return false;
+    }
+    if (!sendAndWaitForReply(_buffer, ONE_SEC, 1) || !strstr(_buffer, _OK))
+    {
+        return false;
+    }
+    uint8_t replies = 0;
+    uint8_t sent = count;
+    uint32_t start = millis();
+    uint32_t limit = (uint32_t)count * (timeout + 1) * ONE_SEC + FIVE_SEC;
+    while (millis() - start < limit)
+    {
+        if (!readReply(limit - (millis() - start), 1))
+        {
+            break;
+        }
+        const char* urc = strstr(_buffer, "+QPING:");
+        if (urc == nullptr)
+        {
+            continue;
+        }
+        if (strchr(urc, '"'))
+        {
+            // Reply of a single ping, <time> is the RTT [ms]
+            int result = -1;
+            unsigned long bytes = 0, time = 0;
+            const char* fields = strchr(strchr(urc, '"') + 1, '"');
+            if (sscanf(urc, "+QPING: %d", &result) == 1 && result == 0 && fields && sscanf(fields, "\",%lu,%lu", &bytes, &time) == 2)
+            {
+                recordProbe(&pingStats, true, time);
+                replies++;
+            }
+            continue;
+        }
+        int result = -1, summarySent = 0, received = 0;
+        int fields = sscanf(urc, "+QPING: %d,%d,%d", &result, &summarySent, &received);
+        if (fields == 3)
+        {
+            // Summary, ends the run
+            sent = summarySent;
+            break;
+        }
+        if (fields == 1 && replies == 0 && result != 569)
+        {
+            // Final error without any ping sent (e.g. DNS failure), nothing is recorded as lost
+            _lastResult.cause = RESULT_STAT_ERROR;
+            _lastResult.statCode = result;
+            _lastResult.transient = true;
+            sent = 0;
+            break;
+        }
+        // 569 = ping timed out
+    }
+    for (uint8_t i = replies; i < sent; i++)
+    {
+        recordProbe(&pingStats, false, 0);
+    }
+    updateProbeRadio(&pingStats);
+    if(_debug != false)
+    {
+        _debugStream->print("\nPing replies: ");
+        _debugStream->print(replies);
+        _debugStream->print("/");
+        _debugStream->print(sent);
+        _debugStream->print(", average RTT [ms]: ");
+        _debugStream->print(pingStats.averageRTT);
+        _debugStream->print(", jitter [ms]: ");
+        _debugStream->println(pingStats.jitter);
+    }
+    return replies > 0;
+}
+
+bool QuectelBC660::probeUDPEcho(uint8_t count, uint32_t timeout)
+{
+    // UDP socket has to be open to a server echoing the datagrams back. Each probe is
+    // "E<sequence>,<millis>" written without compression, a reply counts only for the probe it
+    // belongs to, late replies of earlier probes are dropped. RTT is measured to the arrival of the
+    // +QIURC: "recv" URC, so it includes the module processing of AT+QISEND.
+    // Returns true when at least one reply arrived
+    uint8_t replies = 0;
+    uint8_t reply[24];
+    for (uint8_t i = 0; i < count; i++)
+    {
+        _echoSequence++;
+        uint32_t sentAt = millis();
+        char probe[24];
+        uint8_t probeLen = sprintf(probe, "E%u,%lu", _echoSequence, (unsigned long)sentAt);
+        if (!writeUDP(0, (const uint8_t*)probe, probeLen, RAI_NONE, true))
+        {
+            // Not sent, so not lost in the network either
+            continue;
+        }
+        bool replied = false;
+        uint32_t rtt = 0;
+        uint32_t elapsed;
+        while ((elapsed = millis() - sentAt) < timeout)
+        {
+            int16_t len = receiveDataUDP(reply, sizeof(reply) - 1, timeout - elapsed);
+            if (len <= 0)
+            {
+                break;
+            }
+            reply[len] = 0;
+            unsigned int sequence;
+            if (sscanf((const char*)reply, "E%u,", &sequence) == 1 && sequence == _echoSequence)
+            {
+                // Reply read without a new URC (already buffered) is timed on reading
+                replied = true;
+                rtt = (int32_t)(_udpDataTime - sentAt) >= 0 ? _udpDataTime - sentAt : millis() - sentAt;
+                break;
+            }
+        }
+        recordProbe(&echoStats, replied, rtt);
+        replies += replied;
+    }
+    updateProbeRadio(&echoStats);
+    if(_debug != false)
+    {
+        _debugStream->print("\nUDP echo replies: ");
+        _debugStream->print(replies);
+        _debugStream->print("/");
+        _debugStream->print(count);
+        _debugStream->print(", average RTT [ms]: ");
+        _debugStream->print(echoStats.averageRTT);
+        _debugStream->print(", jitter [ms]: ");
+        _debugStream->println(echoStats.jitter);
+    }
+    return replies > 0;
+}
+
+void QuectelBC660::resetLinkHealth()
+{
+    pingStats = {};
+    echoStats = {};
+}
+
+void QuectelBC660::recordProbe(linkHealthStruct* stats, bool replied, uint32_t rtt)
+{
+    uint8_t window = min(stats->probes, (uint32_t)31);
+    stats->probes++;
+    stats->lastProbe = millis();
+    stats->lossHistory <<= 1;
+    if (!replied)
+    {
+        stats->lost++;
+        stats->lossHistory |= 1;
+    }
+    else
+    {
+        if (stats->probes - stats->lost == 1)
+        {
+            stats->averageRTT = rtt;
+            stats->minRTT = rtt;
+            stats->maxRTT = rtt;
+        }
+        else
+        {
+            uint32_t difference = rtt > stats->lastRTT ? rtt - stats->lastRTT : stats->lastRTT - rtt;
+            stats->jitter = (15 * stats->jitter + difference) / 16;
+            stats->averageRTT = (7 * stats->averageRTT + rtt) / 8;
+            stats->minRTT = min(stats->minRTT, rtt);
+            stats->maxRTT = max(stats->maxRTT, rtt);
+        }
+        stats->lastRTT = rtt;
+    }
+    uint8_t lost = 0;
+    for (uint8_t i = 0; i <= window; i++)
+    {
+        lost += (stats->lossHistory >> i) & 1;
+    }
+    stats->loss = (uint32_t)lost * 1000 / (window + 1);
+}
+
+void QuectelBC660::updateProbeRadio(linkHealthStruct* stats)
+{
+#if QUECTEL_BC660_ENGINEERING
+    if (updateServingCell())
+    {
+        stats->RSRP = engineeringData.RSRP;
+        stats->SINR = engineeringData.SINR;
+        stats->ECL = engineeringData.ECL;
+    }
+#else
+    (void)stats;
+#endif
+}
+#endif
+
+#if QUECTEL_BC660_COAP
+// CoAP client (RFC 7252)
+#define COAP_VERSION 1
+#define COAP_MAX_MESSAGE 128
+// Block size 2^(SZX+4) is the largest one whose message fits one AT+QIRD read (see receiveDataUDP())
+#define COAP_READ_SIZE ((QUECTEL_BC660_BUFFER_SIZE - 24) / 2)
+#define COAP_BLOCK_OVERHEAD 32                  // Header, token, options and payload marker of a block message
+#if COAP_READ_SIZE >= 64 + COAP_BLOCK_OVERHEAD
+#define COAP_BLOCK_SZX 2
+#elif COAP_READ_SIZE >= 32 + COAP_BLOCK_OVERHEAD
+#define COAP_BLOCK_SZX 1
+#else
+#define COAP_BLOCK_SZX 0
+#endif
+#define COAP_BLOCK_SIZE (1 << (COAP_BLOCK_SZX + 4))
+static_assert(COAP_BLOCK_SIZE + COAP_BLOCK_OVERHEAD <= COAP_READ_SIZE, "QUECTEL_BC660_BUFFER_SIZE is too small for CoAP blocks");
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_OPTION_BLOCK2 23
+#define COAP_OPTION_BLOCK1 27
+#define COAP_CODE_CONTINUE 0x5F                 // 2.31 Continue
+
+void QuectelBC660::setCoAPRetransmission(uint32_t ackTimeout, uint8_t maxRetransmit)
+{
+    // Confirmable messages are retransmitted after ackTimeout * (1..1.5), the timeout doubles with every retry
+    _coapAckTimeout = ackTimeout;
+    _coapMaxRetransmit = maxRetransmit;
+}
+
+uint8_t QuectelBC660::getCoAPResponseCode()
+{
+    // Response code of the last request, class in upper 3 bits, detail in lower 5 bits (0x45 = 2.05 Content)
+    return _coapResponseCode;
+}
+
+int16_t QuectelBC660::coapRequest(uint8_t method, const char* path, const uint8_t* payload, uint16_t payloadLen, uint8_t* response, uint16_t responseSize, bool confirmable, int16_t contentFormat)
+{
+    // Returns length of the response payload copied to response, -1 on failure.
+    // Payloads bigger than one block are uploaded with Block1, bigger responses are fetched with Block2.
+    uint8_t msg[COAP_MAX_MESSAGE];
+    uint8_t rx[COAP_MAX_MESSAGE];
+    if (_coapMessageID == 0 && _coapToken == 0)
+    {
+        // Random start so that message IDs are not reused after a reset
+        _coapMessageID = random(0xFFFF);
+        _coapToken = random(0xFFFF);
+    }
+    uint8_t token[2] = {(uint8_t)(++_coapToken >> 8), (uint8_t)_coapToken};
+    bool upload = payloadLen > COAP_BLOCK_SIZE;
+    uint32_t block1 = 0;
+    uint32_t block2 = 0;
+    uint16_t received = 0;
+    _coapResponseCode = 0;
+
+    while (true)
+    {
+        uint16_t mid = ++_coapMessageID;
+        msg[0] = (COAP_VERSION << 6) | ((confirmable ? COAP_CON : COAP_NON) << 4) | sizeof(token);
+        msg[1] = method;
+        msg[2] = mid >> 8;
+        msg[3] = mid;
+        memcpy(msg + 4, token, sizeof(token));
+        uint16_t len = 4 + sizeof(token);
+        uint16_t lastOption = 0;
+
+        // Uri-Path, one option per path segment
+        const char* segment = path;
+        while (segment && *segment)
+        {
+            if (*segment == '/')
+            {
+                segment++;
+                continue;
+            }
+            const char* end = strchr(segment, '/');
+            uint16_t segmentLen = end ? end - segment : strlen(segment);
+            if (!coapAddOption(msg, &len, &lastOption, COAP_OPTION_URI_PATH, (const uint8_t*)segment, segmentLen))
+            {
+                return -1;
+            }
+            segment = end;
+        }
+        uint8_t value[3];
+        uint8_t valueLen;
+        if (contentFormat >= 0 && (block2 == 0 || upload))
+        {
+            valueLen = coapUint(value, contentFormat);
+            if (!coapAddOption(msg, &len, &lastOption, COAP_OPTION_CONTENT_FORMAT, value, valueLen))
+            {
+                return -1;
+            }
+        }
+        // Block2 is also sent with NUM 0 in the request whose response carries the body, so the server
+        // uses blocks that fit one read from the first one (early negotiation, RFC 7959)
+        if (block2 > 0 || !upload || (block1 + 1) * COAP_BLOCK_SIZE >= payloadLen)
+        {
+            valueLen = coapUint(value, (block2 << 4) | COAP_BLOCK_SZX);
+            if (!coapAddOption(msg, &len, &lastOption, COAP_OPTION_BLOCK2, value, valueLen))
+            {
+                return -1;
+            }
+        }
+        uint16_t chunk = 0;
+        const uint8_t* chunkData = payload;
+        if (upload)
+        {
+            uint32_t offset = block1 * COAP_BLOCK_SIZE;
+            chunk = min((uint32_t)COAP_BLOCK_SIZE, (uint32_t)(payloadLen - offset));
+            chunkData = payload + offset;
+            bool more = offset + chunk < payloadLen;
+            valueLen = coapUint(value, (block1 << 4) | (more << 3) | COAP_BLOCK_SZX);
+            if (!coapAddOption(msg, &len, &lastOption, COAP_OPTION_BLOCK1, value, valueLen))
+            {
+                return -1;
+            }
+        }
+        else if (block2 == 0)
+        {
+            chunk = payloadLen;
+        }
+        if (chunk > 0)
+        {
+            if (len + 1 + chunk > COAP_MAX_MESSAGE)
+            {
+                return -1;
+            }
+            msg[len++] = 0xFF;
+            memcpy(msg + len, chunkData, chunk);
+            len += chunk;
+        }
+
+        int16_t rxLen = coapTransaction(msg, len, rx, sizeof(rx));
+        if (rxLen < 4)
+        {
+            return -1;
+        }
+
+        // Parse response options and payload
+        uint8_t tkl = rx[0] & 0x0F;
+        _coapResponseCode = rx[1];
+        uint16_t index = 4 + tkl;
+        uint16_t option = 0;
+        int32_t responseBlock1 = -1;
+        int32_t responseBlock2 = -1;
+        const uint8_t* rxPayload = nullptr;
+        uint16_t rxPayloadLen = 0;
+        while (index < rxLen)
+        {
+            if (rx[index] == 0xFF)
+            {
+                rxPayload = rx + index + 1;
+                rxPayloadLen = rxLen - index - 1;
+                break;
+            }
+            uint16_t delta = rx[index] >> 4;
+            uint16_t optionLen = rx[index] & 0x0F;
+            index++;
+            // Nibble 15 is reserved, 13 and 14 are followed by one or two extended bytes
+            if (delta == 15 || optionLen == 15)
+            {
+                return -1;
+            }
+            uint8_t extended = (delta == 13) + (delta == 14) * 2 + (optionLen == 13) + (optionLen == 14) * 2;
+            if (index + extended > rxLen)
+            {
+                return -1;
+            }
+            if (delta == 13) { delta = 13 + rx[index++]; }
+            else if (delta == 14) { delta = 269 + ((rx[index] << 8) | rx[index + 1]); index += 2; }
+            if (optionLen == 13) { optionLen = 13 + rx[index++]; }
+            else if (optionLen == 14) { optionLen = 269 + ((rx[index] << 8) | rx[index + 1]); index += 2; }
+            if ((int32_t)index + optionLen > rxLen)
+            {
+                return -1;
+            }
+            option += delta;
+            if (option == COAP_OPTION_BLOCK1 || option == COAP_OPTION_BLOCK2)
+            {
+                uint32_t blockValue = 0;
+                for (uint16_t i = 0; i < optionLen; i++)
+                {
+                    blockValue = (blockValue << 8) | rx[index + i];
+                }
+                if (option == COAP_OPTION_BLOCK1)
+                {
+                    responseBlock1 = blockValue;
+                }
+                else
+                {
+                    responseBlock2 = blockValue;
+                }
+            }
+            index += optionLen;
+        }
+
+        if (upload)
+        {
+            if ((_coapResponseCode >> 5) != 2)
+            {
+                return -1;
+            }
+            if ((block1 + 1) * COAP_BLOCK_SIZE < payloadLen)
+            {
+                // Server asked for the next block (2.31 Continue)
+                block1++;
+                continue;
+            }
+            upload = false;
+        }
+        (void)responseBlock1;
+
+        if (rxPayload)
+        {
+            uint16_t copy = min((uint16_t)rxPayloadLen, (uint16_t)(responseSize - received));
+            memcpy(response + received, rxPayload, copy);
+            received += copy;
+        }
+        if (responseBlock2 >= 0 && (responseBlock2 & 0x08) && received < responseSize)
+        {
+            // More blocks of the response are available
+            block2 = (responseBlock2 >> 4) + 1;
+            continue;
+        }
+        if(_debug != false)
+        {
+            _debugStream->print("\nCoAP response code: ");
+            _debugStream->print(_coapResponseCode >> 5);
+            _debugStream->print(".");
+            _debugStream->print(_coapResponseCode & 0x1F);
+            _debugStream->print(", payload size: ");
+            _debugStream->println(received);
+        }
+        return received;
+    }
+}
+
+int16_t QuectelBC660::coapTransaction(const uint8_t* msg, uint16_t msgLen, uint8_t* rx, uint16_t rxSize)
+{
+    // Sends request and waits for the matching response (piggybacked in ACK or separate CON/NON).
+    // Confirmable requests are retransmitted with exponential backoff until acknowledged.
+    bool confirmable = ((msg[0] >> 4) & 0x03) == COAP_CON;
+    uint8_t tkl = msg[0] & 0x0F;
+    uint16_t mid = (msg[2] << 8) | msg[3];
+    uint32_t timeout = _coapAckTimeout + random(_coapAckTimeout / 2);
+    bool acknowledged = false;
+
+    for (uint8_t attempt = 0; attempt <= (confirmable ? _coapMaxRetransmit : 0); attempt++)
+    {
+        if (!acknowledged && !writeUDP(0, msg, msgLen, RAI_NONE, true))
+        {
+            return -1;
+        }
+        uint32_t start = millis();
+        while (millis() - start < timeout)
+        {
+            int16_t rxLen = receiveDataUDP(rx, rxSize, timeout - (millis() - start));
+            if (rxLen < 0)
+            {
+                return -1;
+            }
+            if (rxLen < 4 || (rx[0] >> 6) != COAP_VERSION)
+            {
+                continue;
+            }
+            uint8_t type = (rx[0] >> 4) & 0x03;
+            uint16_t rxMid = (rx[2] << 8) | rx[3];
+            bool tokenMatch = (rx[0] & 0x0F) == tkl && rxLen >= 4 + tkl && memcmp(rx + 4, msg + 4, tkl) == 0;
+
+            if (type == COAP_CON || type == COAP_NON)
+            {
+                // Message-ID deduplication of messages initiated by the server
+                bool duplicate = false;
+                // Entries are written from index 0, the first _coapSeenCount are valid
+                for (uint8_t i = 0; i < _coapSeenCount; i++)
+                {
+                    if (_coapSeen[i] == rxMid)
+                    {
+                        duplicate = true;
+                    }
+                }
+                if (type == COAP_CON)
+                {
+                    // Acknowledge (again) with empty ACK
+                    uint8_t ack[4] = {(COAP_VERSION << 6) | (COAP_ACK << 4), 0, rx[2], rx[3]};
+                    writeUDP(0, ack, sizeof(ack), RAI_NONE, true);
+                }
+                if (duplicate)
+                {
+                    continue;
+                }
+                _coapSeen[_coapSeenIndex] = rxMid;
+                _coapSeenIndex = (_coapSeenIndex + 1) % (sizeof(_coapSeen) / sizeof(_coapSeen[0]));
+                if (_coapSeenCount < sizeof(_coapSeen) / sizeof(_coapSeen[0]))
+                {
+                    _coapSeenCount++;
+                }
+                if (tokenMatch)
+                {
+                    return rxLen;
+                }
+                continue;
+            }
+            if (rxMid != mid)
+            {
+                continue;
+            }
+            if (type == COAP_RST)
+            {
+                return -1;
+            }
+            // ACK
+            if (rx[1] != 0 && tokenMatch)
+            {
+                return rxLen;
+            }
+            if (rx[1] == 0 && !acknowledged)
+            {
+                // Empty ACK, response follows as separate message, stop retransmitting
+                acknowledged = true;
+                timeout = _coapAckTimeout << _coapMaxRetransmit;
+                start = millis();
+            }
+        }
+        if (acknowledged)
+        {
+            break;
+        }
+        timeout *= 2;
+        if(_debug != false)
+        {
+            _debugStream->println("\nCoAP retransmission");
+        }
+    }
+    return -1;
+}
+
+bool QuectelBC660::coapAddOption(uint8_t* msg, uint16_t* len, uint16_t* lastOption, uint16_t number, const uint8_t* value, uint16_t valueLen)
+{
+    // Options are delta encoded, extended delta/length is used for values >= 13
+    if (*len + 5 + valueLen > COAP_MAX_MESSAGE)
+    {
+        return false;
+    }
+    uint16_t delta = number - *lastOption;
+    uint16_t index = *len + 1;
+    uint8_t header = 0;
+    if (delta < 13) { header = delta << 4; }
+    else if (delta < 269) { header = 13 << 4; msg[index++] = delta - 13; }
+    else { header = 14 << 4; msg[index++] = (delta - 269) >> 8; msg[index++] = delta - 269; }
+    if (valueLen < 13) { header |= valueLen; }
+    else if (valueLen < 269) { header |= 13; msg[index++] = valueLen - 13; }
+    else { header |= 14; msg[index++] = (valueLen - 269) >> 8; msg[index++] = valueLen - 269; }
+    msg[*len] = header;
+    memcpy(msg + index, value, valueLen);
+    *len = index + valueLen;
+    *lastOption = number;
+    return true;
+}
+
+uint8_t QuectelBC660::coapUint(uint8_t* value, uint32_t number)
+{
+    // Minimal big-endian encoding of uint option values (0 is encoded as empty value)
+    uint8_t len = 0;
+    if (number > 0xFFFF) { value[len++] = number >> 16; }
+    if (number > 0xFF) { value[len++] = number >> 8; }
+    if (number > 0) { value[len++] = number; }
+    return len;
+}
+#endif
+
+#if QUECTEL_BC660_ENGINEERING
+// Coverage-aware scheduling
+// Relative number of uplink repetitions per coverage enhancement level. At ECL 1 and 2 the network
+// repeats every transmission many times, so the same payload costs far more airtime and energy.
+static const uint8_t ECL_REPETITIONS[3] = {1, 8, 32};
+#define AIRTIME_PER_BYTE_US 800         // Approximate uplink airtime per byte at ECL 0 (single-tone, 15 kHz)
+#define AIRTIME_OVERHEAD_BYTES 60       // Random access, RRC and IP/UDP header overhead counted as payload bytes
+
+void QuectelBC660::setCoverageThresholds(int16_t minRSRP, int8_t minSINR, uint8_t maxECL, uint32_t checkInterval)
+{
+    // Coverage is considered good enough to transmit when RSRP >= minRSRP, SINR >= minSINR and ECL <= maxECL
+    _minRSRP = minRSRP;
+    _minSINR = minSINR;
+    _maxECL = maxECL;
+    _coverageCheckInterval = checkInterval;
+}
+
+bool QuectelBC660::waitForCoverage(uint32_t deadline, uint16_t msgLen)
+{
+    // Returns true when coverage is good (or can not be judged), false when the deadline expired.
+    // In both cases the caller is expected to transmit right after this function returns.
+    coverageStats.scheduledSends++;
+    if(deadline == 0 || !updateServingCell())
+    {
+        return true;
+    }
+    uint8_t firstECL = engineeringData.ECL;
+    uint32_t start = millis();
+    bool deferred = false;
+    while(!coverageIsGood())
+    {
+        uint32_t waited = millis() - start;
+        if(waited >= deadline)
+        {
+            if(_debug != false)
+            {
+                _debugStream->println("\nCoverage deadline expired, sending anyway");
+            }
+            coverageStats.expiredDeadlines++;
+            coverageStats.deferredTime += waited;
+            return false;
+        }
+        if(!deferred)
+        {
+            deferred = true;
+            coverageStats.deferredSends++;
+        }
+        if(_debug != false)
+        {
+            _debugStream->print("\nCoverage too poor, deferring send. ECL: ");
+            _debugStream->print(engineeringData.ECL);
+            _debugStream->print(", RSRP: ");
+            _debugStream->print(engineeringData.RSRP);
+            _debugStream->print(", SINR: ");
+            _debugStream->println(engineeringData.SINR);
+        }
+        delay(min(_coverageCheckInterval, deadline - waited));
+        if(!updateServingCell())
+        {
+            break;
+        }
+    }
+    if(deferred)
+    {
+        coverageStats.deferredTime += millis() - start;
+        uint32_t before = estimateAirtime(msgLen, firstECL);
+        uint32_t after = estimateAirtime(msgLen, engineeringData.ECL);
+        if(before > after)
+        {
+            coverageStats.savedAirtime += before - after;
+        }
+    }
+    return true;
+}
+
+bool QuectelBC660::sendDataUDPScheduled(const char* msg, uint16_t msgLen, uint32_t deadline, uint8_t RAI)
+{
+    waitForCoverage(deadline, msgLen);
+    return sendDataUDP(msg, msgLen, RAI);
+}
+
+#if QUECTEL_BC660_MQTT
+bool QuectelBC660::publishMQTTScheduled(const char* msg, uint16_t msgLen, const char* topic, uint32_t deadline, uint16_t msgID, uint8_t QoS, uint8_t retain, bool compressed, uint8_t RAI)
+{
+    waitForCoverage(deadline, msgLen);
+    return publishMQTT(msg, msgLen, topic, msgID, QoS, retain, compressed, RAI);
+}
+#endif
+
+bool QuectelBC660::coverageIsGood()
+{
+    return engineeringData.ECL <= _maxECL && engineeringData.RSRP >= _minRSRP && engineeringData.SINR >= _minSINR;
+}
+
+uint32_t QuectelBC660::estimateAirtime(uint16_t msgLen, uint8_t ECL)
+{
+    if(ECL > 2)
+    {
+        ECL = 2;
+    }
+    return ((uint32_t)(msgLen + AIRTIME_OVERHEAD_BYTES) * AIRTIME_PER_BYTE_US * ECL_REPETITIONS[ECL]) / 1000;
+}
+
+// Engineering data functions
+void QuectelBC660::getData(){
+    // Engineering data
+    updateServingCell();
+
+    // Firmware  version
+    wakeUp();
+    if (sendAndWaitForReply("AT+CGMR", 1000, 3))
+    {
+		// response is:
+        // Revision: BC660KGLAAR01A01
+        // 
+        // OK
+
+        char * token = strtok(_buffer, "\n");
+        if (token)
+        {
+            strncpy(engineeringData.firmwareVersion, token + 10, sizeof(engineeringData.firmwareVersion) - 1);
+            engineeringData.firmwareVersion[sizeof(engineeringData.firmwareVersion) - 1] = 0;
+        }
+    }
+
+    // Date and time (served by the local time service, AT+CCLK? is only sent when a resync is due)
+    engineeringData.epoch = getEpoch();
+    engineeringData.timezone = _timezone / 4;
+
+    
+
+}
+
+bool QuectelBC660::updateServingCell()
+{
+    // +QENG: 0,<sc_EARFCN>,<sc_EARFCN_offset>,<sc_pci>,<sc_cellID>,[<sc_RSRP>],[<sc_RSRQ>],[<sc_RSSI>],[<sc_SINR>],<sc_band>,<sc_TAC>,[<sc_ECL>],[<sc_Tx_pwr>],<operation_mode>
+    wakeUp();
+    if (sendAndWaitForReply("AT+QENG=0", 1000, 3))
+    {
+        // Optional fields are empty when not reported, so split on each comma to keep the positions
+        char * end = strpbrk(_buffer, "\r\n");
+        if (end)
+        {
+            *end = '\0';
+        }
+        char * field = _buffer;
+        uint8_t index = 0;
+        bool band = false, ECL = false;
+        while (field)
+        {
+            char * next = strchr(field, ',');
+            if (next)
+            {
+                *next++ = '\0';
+            }
+            if (*field)
+            {
+                // <sc_cellID>, <sc_TAC>, <sc_Tx_pwr> and <operation_mode> are not used
+                if (index == 1)
+                {
+                    engineeringData.EARFCN = strtoul(field, nullptr, 10);
+                }
+                else if (index == 2)
+                {
+                    engineeringData.EARFCNOffset = strtol(field, nullptr, 10);
+                }
+                else if (index == 3)
+                {
+                    engineeringData.PCI = strtol(field, nullptr, 10);
+                }
+                else if (index == 5)
+                {
+                    engineeringData.RSRP = strtol(field, nullptr, 10);
+                }
+                else if (index == 6)
+                {
+                    engineeringData.RSRQ = strtol(field, nullptr, 10);
+                }
+                else if (index == 7)
+                {
+                    engineeringData.RSSI = strtol(field, nullptr, 10);
+                }
+                else if (index == 8)
+                {
+                    engineeringData.SINR = strtol(field, nullptr, 10);
+                }
+                else if (index == 9)
+                {
+                    engineeringData.band = strtol(field, nullptr, 10);
+                    band = true;
+                }
+                else if (index == 11)
+                {
+                    engineeringData.ECL = strtol(field, nullptr, 10);
+                    ECL = true;
+                }
+            }
+            field = next;
+            index++;
+        }
+        return band && ECL;
+    }
+    return false;
+}
+
+// Fast attach
+// Bands supported by BC660K-GL
+static const uint8_t SUPPORTED_BANDS[] = {1, 2, 3, 4, 5, 8, 12, 13, 17, 18, 19, 20, 25, 28, 66, 70, 71, 85};
+
+void QuectelBC660::setAttachCacheStore(attachCacheStruct* cache)
+{
+    // Cache kept by the application, e.g. in RTC memory or flash, so it survives power cycles
+    _attachCache = cache;
+}
+
+bool QuectelBC660::attachToNetwork(uint32_t timeout, uint32_t fallbackTimeout, bool lockBand)
+{
+    // With a cached cell: AT+QLOCKF on the cached EARFCN and registration to the cached PLMN, so the
+    // module does not scan all bands. If that does not attach within timeout, the lock is removed and
+    // the configured bands are scanned. The frequency lock is removed once attached, the configured
+    // bands are kept. lockBand also limits AT+QBAND to the cached band. That limit stays after the
+    // attach (AT+QBAND while attached makes the module attach again), so reattaches by the module itself
+    // only search that band until the next full scan. Use it only for stationary devices.
+    // The full scan uses the bands of the last setManualBand() or setAutoBand(), all bands after a
+    // fast attach with lockBand when neither was called.
+    if (getRegistrationStatus(1, 0))
+    {
+        return true;
+    }
+    if (_attachCache->band != 0)
+    {
+        // Attach times are measured from the deregistered state
+        deregisterFromNetwork(ONE_MIN);
+        uint32_t start = millis();
+        bool attached = true;
+        if (lockBand)
+        {
+            attached = writeBands(1, &_attachCache->band, true, FIVE_SEC);
+        }
+        else
+        {
+            // A failed attempt is counted against the cached band only
+            _lastBands[0] = _attachCache->band;
+            _numOfLastBands = 1;
+        }
+        if (attached)
+        {
+            snprintf(_buffer, sizeof(_buffer), "AT+QLOCKF=1,%lu,%d", (unsigned long)_attachCache->EARFCN, _attachCache->EARFCNOffset);
+            sendAndCheckReply(_buffer, _OK, 1000);
+            if (_attachCache->PLMN[0] != 0)
+            {
+                attached = manualRegisterToNetwork(_attachCache->PLMN, 4, 2, timeout);
+            }
+            else
+            {
+                attached = autoRegisterToNetwork(timeout);
+            }
+        }
+        sendAndCheckReply("AT+QLOCKF=0", _OK, 1000);
+        if (attached)
+        {
+            uint32_t attachTime = millis() - start;
+            _attachCache->fastAttaches++;
+            _attachCache->fastAttachTime += attachTime;
+            if(_debug != false)
+            {
+                _debugStream->print("\nFast attach on band ");
+                _debugStream->print(_attachCache->band);
+                _debugStream->print(" took [ms]: ");
+                _debugStream->println(attachTime);
+            }
+            updateAttachCache();
+            return true;
+        }
+        _attachCache->fastFailures++;
+        if(_debug != false)
+        {
+            _debugStream->println("\nFast attach failed, scanning all bands");
+        }
+    }
+    deregisterFromNetwork(ONE_MIN);
+    uint32_t start = millis();
+    if (_bandsSet || lockBand)
+    {
+        // Bands set by the application, in the learned order
+        if (_numOfBands > 0)
+        {
+            writeBands(_numOfBands, _bands, true, FIVE_SEC);
+        }
+        else if (_bandLearning)
+        {
+            // Same bands as AT+QBAND=0
+            uint8_t bands[sizeof(SUPPORTED_BANDS)];
+            memcpy(bands, SUPPORTED_BANDS, sizeof(SUPPORTED_BANDS));
+            writeBands(sizeof(bands), bands, true, FIVE_SEC);
+        }
+        else
+        {
+            setAutoBand(true, FIVE_SEC);
+        }
+    }
+    else
+    {
+        // Bands configured in the module are not known and left as they are, a failure is not counted per band
+        _numOfLastBands = 0;
+    }
+    if (!autoRegisterToNetwork(fallbackTimeout))
+    {
+        return false;
+    }
+    _attachCache->fullScans++;
+    _attachCache->fullScanTime += millis() - start;
+    updateAttachCache();
+    return true;
+}
+
+bool QuectelBC660::updateAttachCache()
+{
+    // Serving cell from AT+QENG, PLMN from AT+COPS? in numeric format:
+    // +COPS: <mode>,2,"<oper>",<AcT>
+    if (!updateServingCell() || engineeringData.band == 0)
+    {
+        return false;
+    }
+    _attachCache->band = engineeringData.band;
+    _attachCache->EARFCN = engineeringData.EARFCN;
+    _attachCache->EARFCNOffset = engineeringData.EARFCNOffset;
+    if (sendAndCheckReply("AT+COPS=3,2", _OK, 1000) && sendAndWaitForReply("AT+COPS?", 1000, 3))
+    {
+        char * token = strchr(_buffer, '"');
+        if (token)
+        {
+            token++;
+            size_t len = strcspn(token, "\"");
+            if (len < sizeof(_attachCache->PLMN))
+            {
+                memcpy(_attachCache->PLMN, token, len);
+                _attachCache->PLMN[len] = 0;
+            }
+        }
+    }
+    return true;
+}
+
+// Learned band order
+#define BAND_UNKNOWN_TIME ONE_MIN       // Expected attach time of a band without history [ms]
+
+void QuectelBC660::setBandLearning(bool enable)
+{
+    // Registrations record the serving band and attach time, setManualBand() sorts its list by them
+    _bandLearning = enable;
+}
+
+void QuectelBC660::setBandHistoryStore(bandHistoryStruct* history)
+{
+    // Array of BAND_HISTORY_SIZE entries kept by the application, e.g. in RTC memory or flash
+    _bandHistory = history;
+}
+
+uint32_t QuectelBC660::expectedAttachTime(uint8_t band)
+{
+    // Average attach time divided by the success rate, so bands that often fail move back.
+    // Bands without history get a fixed estimate, bands that never attached sort behind them.
+    for (uint8_t i = 0; i < BAND_HISTORY_SIZE; i++)
+    {
+        bandHistoryStruct* entry = &_bandHistory[i];
+        if (entry->band != band || entry->attempts == 0)
+        {
+            continue;
+        }
+        if (entry->successes == 0)
+        {
+            return BAND_UNKNOWN_TIME * (entry->attempts + 1);
+        }
+        return (uint64_t)entry->averageTime * entry->attempts / entry->successes;
+    }
+    return BAND_UNKNOWN_TIME;
+}
+
+void QuectelBC660::orderBands(uint8_t numOfBands, uint8_t* bands)
+{
+    // Stable insertion sort, bands with equal expectation keep the caller's order
+    for (uint8_t i = 1; i < numOfBands; i++)
+    {
+        uint8_t band = bands[i];
+        uint32_t expected = expectedAttachTime(band);
+        int8_t j = i - 1;
+        while (j >= 0 && expectedAttachTime(bands[j]) > expected)
+        {
+            bands[j + 1] = bands[j];
+            j--;
+        }
+        bands[j + 1] = band;
+    }
+}
+
+QuectelBC660::bandHistoryStruct* QuectelBC660::bandEntry(uint8_t band)
+{
+    // Entry of the band, or the entry with the fewest successes is replaced. Of those the one with the
+    // fewest attempts goes first, so unused entries are taken before bands that keep failing.
+    bandHistoryStruct* entry = &_bandHistory[0];
+    for (uint8_t i = 0; i < BAND_HISTORY_SIZE; i++)
+    {
+        if (_bandHistory[i].band == band)
+        {
+            return &_bandHistory[i];
+        }
+        if (_bandHistory[i].successes < entry->successes || (_bandHistory[i].successes == entry->successes && _bandHistory[i].attempts < entry->attempts))
+        {
+            entry = &_bandHistory[i];
+        }
+    }
+    *entry = {};
+    entry->band = band;
+    return entry;
+}
+
+void QuectelBC660::recordAttach(bool attached, uint32_t attachTime)
+{
+    if (!_bandLearning)
+    {
+        return;
+    }
+    if (!attached)
+    {
+        // None of the configured bands attached, bands without an entry get one so they move back
+        for (uint8_t i = 0; i < _numOfLastBands; i++)
+        {
+            bandHistoryStruct* entry = bandEntry(_lastBands[i]);
+            if (entry->attempts < 0xFFFF)
+            {
+                entry->attempts++;
+            }
+        }
+        return;
+    }
+    if (!updateServingCell() || engineeringData.band == 0)
+    {
+        return;
+    }
+    bandHistoryStruct* entry = bandEntry(engineeringData.band);
+    entry->averageTime = entry->successes == 0 ? attachTime : (entry->averageTime * 3 + attachTime) / 4;
+    if (entry->attempts < 0xFFFF)
+    {
+        entry->attempts++;
+        entry->successes++;
+    }
+    if(_debug != false)
+    {
+        _debugStream->print("\nAttached on band ");
+        _debugStream->print(entry->band);
+        _debugStream->print(", average attach time [ms]: ");
+        _debugStream->println(entry->averageTime);
     }
-    return false;
 }
 
-bool QuectelBC660::closeUDP()
+#endif
+
+// Results and retry policy
+QuectelBC660::resultStruct QuectelBC660::getLastResult()
 {
-    sprintf(_buffer, "AT+QICLOSE=%d", _TCPconnectID);
-    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    return _lastResult;
+}
+
+void QuectelBC660::setRetryPolicy(uint8_t maxAttempts, uint32_t baseDelay, uint32_t maxDelay, uint8_t jitter)
+{
+    // Backoff before retry n (n = 0 after the first failure) is baseDelay * 2^n limited to maxDelay,
+    // shortened by a random part of up to jitter percent so that devices do not retry in sync
+    _retryMaxAttempts = maxAttempts;
+    _retryBaseDelay = baseDelay;
+    _retryMaxDelay = maxDelay;
+    _retryJitter = min(jitter, (uint8_t)100);
+}
+
+bool QuectelBC660::retryAfterFailure(uint8_t attempt)
+{
+    // Call after a failed operation, attempt is the number of retries done so far.
+    // Waits for the backoff and returns true when the operation should be repeated,
+    // returns false immediately for permanent failures or when all attempts are used.
+    //
+    // for(uint8_t attempt = 0; !quectel.openUDP(host, port); attempt++)
+    // {
+    //     if(!quectel.retryAfterFailure(attempt)) break;
+    // }
+    if (!_lastResult.transient || attempt + 1 >= _retryMaxAttempts)
     {
         if(_debug != false)
         {
-            Serial.println("\nFailed to close UDP connection!");
+            _debugStream->print("\nNot retrying, cause: ");
+            _debugStream->print(_lastResult.cause);
+            _debugStream->println(_lastResult.transient ? " (attempts used)" : " (permanent)");
         }
         return false;
     }
+    uint32_t backoff = _retryBaseDelay;
+    for (uint8_t i = 0; i < attempt && backoff < _retryMaxDelay; i++)
+    {
+        backoff *= 2;
+    }
+    backoff = min(backoff, _retryMaxDelay);
+    backoff -= random(backoff / 100 * _retryJitter + 1);
     if(_debug != false)
-        {
-            Serial.println("\nUDP connection closed successfully!");
-        }
+    {
+        _debugStream->print("\nRetrying after [ms]: ");
+        _debugStream->println(backoff);
+    }
+    delay(backoff);
     return true;
 }
 
-bool QuectelBC660::sendDataUDP(const char* msg, uint16_t msgLen)
+#if QUECTEL_BC660_ADAPTIVE_TIMEOUTS
+// Adaptive command timeouts
+// Commands whose worst case timeout is long compared to the usual latency. Other commands always use
+// their fixed timeout, some of them (e.g. AT+QBAND) wait for network events with unrelated latency.
+static const char* const LATENCY_COMMANDS[LATENCY_CLASSES] = {"AT+QIOPEN", "AT+QMTOPEN", "AT+QMTCONN=", "AT+QMTCLOSE", "AT+COPS=0"};
+#define LATENCY_NONE 0xFF
+#define LATENCY_MIN_SAMPLES 3
+
+void QuectelBC660::setAdaptiveTimeouts(bool enable, uint32_t floor, uint32_t ceiling)
+{
+    // Timeout = average + 4 * deviation of the observed latency (as TCP RTO), limited to
+    // floor..min(ceiling, fixed timeout of the command). Latency is learned even when disabled.
+    _adaptiveTimeouts = enable;
+    _timeoutFloor = floor;
+    _timeoutCeiling = ceiling;
+}
+
+void QuectelBC660::setLatencyStore(latencyStruct* store)
+{
+    // Array of LATENCY_CLASSES entries kept by the application, e.g. in RTC memory, so the learned
+    // latency survives MCU deep sleep
+    _latency = store;
+}
+
+uint32_t QuectelBC660::adaptTimeout(const char* command, uint32_t timeout)
 {
-    sprintf(_buffer, "AT+QISEND=%d,%d", _TCPconnectID, msgLen);
-    if (!sendAndWaitFor(_buffer, ">", 5000))
+    _latencyClass = LATENCY_NONE;
+    _commandStart = millis();
+    for (uint8_t i = 0; i < LATENCY_CLASSES; i++)
     {
-        if(_debug != false)
+        if (strncmp(command, LATENCY_COMMANDS[i], strlen(LATENCY_COMMANDS[i])) == 0)
         {
-            Serial.print("\nError occured before data send command");
+            _latencyClass = i;
+            break;
         }
-        return false;
     }
-    if(_debug != false)
+    if (!_adaptiveTimeouts || _latencyClass == LATENCY_NONE || _latency[_latencyClass].samples < LATENCY_MIN_SAMPLES)
     {
-        Serial.print("\n --> msg: ");
-        Serial.print(msg);
-        Serial.print(" , size: ");
-        Serial.println(msgLen);
+        return timeout;
     }
-    _uart->write(msg, msgLen);
-    if (readReply(5000, 3) && strstr(_buffer, "SEND OK"))
+    latencyStruct* latency = &_latency[_latencyClass];
+    uint32_t learned = latency->average + 4 * latency->deviation;
+    // Caller timeout below the floor lowers the floor too, constrain() needs floor <= ceiling
+    uint32_t ceiling = min(timeout, _timeoutCeiling);
+    learned = constrain(learned, min(_timeoutFloor, ceiling), ceiling);
+    if(_debug != false && learned != timeout)
     {
-        return true;
+        _debugStream->print("\n(Adaptive timeout [ms]: ");
+        _debugStream->print(learned);
+        _debugStream->println(")");
     }
-    if(_debug != false)
+    return learned;
+}
+
+void QuectelBC660::recordLatency(bool replied)
+{
+    // EWMA of latency and its mean deviation (RFC 6298 gains 1/8 and 1/4).
+    // On timeout no sample is taken, the deviation is doubled instead so the next timeout backs off.
+    if (_latencyClass == LATENCY_NONE)
     {
-        Serial.print("\nSend failed");
+        return;
     }
-    return false;
+    latencyStruct* latency = &_latency[_latencyClass];
+    _latencyClass = LATENCY_NONE;
+    if (!replied)
+    {
+        latency->deviation = min(latency->deviation * 2 + 1, _timeoutCeiling);
+        latency->timeouts++;
+        return;
+    }
+    uint32_t sample = millis() - _commandStart;
+    if (latency->samples == 0)
+    {
+        latency->average = sample;
+        latency->deviation = sample / 2;
+    }
+    else
+    {
+        uint32_t difference = sample > latency->average ? sample - latency->average : latency->average - sample;
+        latency->deviation = (3 * latency->deviation + difference) / 4;
+        latency->average = (7 * latency->average + sample) / 8;
+    }
+    if (latency->samples < 0xFFFF)
+    {
+        latency->samples++;
+    }
+}
+#else
+uint32_t QuectelBC660::adaptTimeout(const char* command, uint32_t timeout)
+{
+    (void)command;
+    return timeout;
 }
 
-// Engineering data functions
-void QuectelBC660::getData(){
-    // Engineering data
-    // +QENG: 0,<sc_EARFCN>,<sc_EARFCN_offset>,<sc_pci>,<sc_cellID>,[<sc_RSRP>],[<sc_RSRQ>],[<sc_RSSI>],[<sc_SINR>],<sc_band>,<sc_TAC>,[<sc_ECL>],[<sc_Tx_pwr>],<operation_mode>
-    wakeUp();
-    if (sendAndWaitForReply("AT+QENG=0", 1000, 3))
+void QuectelBC660::recordLatency(bool replied)
+{
+    (void)replied;
+}
+#endif
+
+// Command sequences
+uint8_t QuectelBC660::runSequence(const sequenceStep* steps, uint8_t numOfSteps, stepResultStruct* results)
+{
+    // Steps run in order until one fails, after that only rollback (SEQUENCE_ON_FAILURE) and cleanup
+    // (SEQUENCE_ALWAYS) steps run. Sleep is disabled (AT+QSCLK=0) before the first step, so the module
+    // is woken once and stays awake until a sleep step enables sleep again. Without such a step the
+    // previous sleep mode is restored at the end. Sleep steps that do not change the mode send nothing.
+    // Consecutive QoS 1/2 publishes and inline UDP sends are pipelined, their completions are collected
+    // before a step of another kind.
+    // Returns index of the first failed step, numOfSteps when all steps succeeded.
+    _sequenceResults = results;
+    _sequenceFailed = 0xFF;
+    if (results)
     {
-        char * token = strtok(_buffer, ",");
-        for(int i = 0; i < 4; i++)
+        memset(results, 0, sizeof(stepResultStruct) * numOfSteps);
+    }
+    uint8_t previousAction = 0xFF;
+    bool started = false;
+    uint8_t restoreSleep = 0;
+    for (uint8_t i = 0; i < numOfSteps; i++)
+    {
+        const sequenceStep* step = &steps[i];
+        if (step->action != previousAction)
         {
-            token = strtok(nullptr, ",");
+            completeSequenceSends();
         }
-        token = strtok(nullptr, ",");
-        if(token)
+        bool failedBefore = _sequenceFailed != 0xFF;
+        if ((step->run == SEQUENCE_ON_SUCCESS && failedBefore) || (step->run == SEQUENCE_ON_FAILURE && !failedBefore))
         {
-                char* ptr;
-                engineeringData.RSRP =  strtol(token, &ptr, 10);
+            continue;
         }
-        token = strtok(nullptr, ",");
-        if(token)
+        if (!started)
         {
-                char* ptr;
-                engineeringData.RSRQ =  strtol(token, &ptr, 10);
+            // wakeUp() does nothing while the wake is held, so the module must not be able to sleep
+            started = true;
+            restoreSleep = _sleepMode;
+            if (_sleepMode != 0 && !setDeepSleep(0))
+            {
+                // Mode is unchanged, every step wakes the module itself
+                restoreSleep = 0;
+            }
+            _holdAwake = _sleepMode == 0;
         }
-        token = strtok(nullptr, ",");
-        if(token)
+        else if (!_holdAwake)
         {
-                char* ptr;
-                engineeringData.RSSI =  strtol(token, &ptr, 10);
+            // Sleep was enabled by a step, not every command wakes the module itself
+            wakeUp();
         }
-        token = strtok(nullptr, ",");
-        if(token)
+        uint32_t start = millis();
+        bool succeeded = runStep(step, i);
+        // A fast publish failure may already be set on this step by checkURC()
+        if (_sequenceFailed == i)
         {
-                char* ptr;
-                engineeringData.SINR =  strtol(token, &ptr, 10);
+            succeeded = false;
+        }
+        else if (results)
+        {
+            results[i].succeeded = succeeded;
+            results[i].result = _lastResult;
+        }
+        if (results)
+        {
+            results[i].executed = true;
+            results[i].duration = millis() - start;
+        }
+        if (!succeeded && i < _sequenceFailed)
+        {
+            _sequenceFailed = i;
+        }
+        if (step->action == SEQUENCE_SLEEP)
+        {
+            // Sleep mode set by the sequence is kept
+            restoreSleep = 0;
         }
+        previousAction = step->action;
+    }
+    completeSequenceSends();
+    _holdAwake = false;
+    if (restoreSleep != 0)
+    {
+        setDeepSleep(restoreSleep);
+    }
+    _sequenceResults = nullptr;
+    if(_debug != false)
+    {
+        _debugStream->print("\nSequence done, failed step: ");
+        _debugStream->println(_sequenceFailed == 0xFF ? -1 : _sequenceFailed);
     }
+    return _sequenceFailed == 0xFF ? numOfSteps : _sequenceFailed;
+}
 
-    // Firmware  version
-    wakeUp();
-    if (sendAndWaitForReply("AT+CGMR", 1000, 3))
+bool QuectelBC660::runStep(const sequenceStep* step, uint8_t index)
+{
+    switch (step->action)
     {
-		// response is:
-        // Revision: BC660KGLAAR01A01
-        // 
-        // OK
+        case SEQUENCE_SLEEP:
+        {
+            if (step->value == _sleepMode)
+            {
+                return true;
+            }
+            bool set = setDeepSleep(step->value);
+            if (_sleepMode != 0)
+            {
+                // Module may sleep from now on, the next step wakes it again
+                _holdAwake = false;
+            }
+            return set;
+        }
+#if QUECTEL_BC660_MQTT
+        case SEQUENCE_OPEN_MQTT:
+            return openMQTT(step->text, step->value != 0 ? step->value : 1883);
+        case SEQUENCE_CONNECT_MQTT:
+            return connectMQTT(step->text);
+        case SEQUENCE_PUBLISH_MQTT:
+        {
+            if (step->option == 0)
+            {
+                return publishMQTT(step->data, step->value, step->text);
+            }
+            // Message ID is registered for the step by publishMQTTAsync() before the command is sent
+            _sequencePublishStep = index;
+            bool published = publishMQTTAsync(step->data, step->value, step->text, step->option);
+            _sequencePublishStep = 0xFF;
+            return published;
+        }
+        case SEQUENCE_CLOSE_MQTT:
+            return closeMQTT();
+#endif
+        case SEQUENCE_OPEN_UDP:
+            return openUDP(step->text, step->value);
+        case SEQUENCE_SEND_UDP:
+            if (_udpSendMode == UDP_SEND_INLINE)
+            {
+                _sequenceUDPStep = index;
+                return queueDataUDP(step->data, step->value, step->option);
+            }
+            return sendDataUDP(step->data, step->value, step->option);
+        case SEQUENCE_CLOSE_UDP:
+            return closeUDP();
+    }
+    // Unknown action or feature not built in
+    _lastResult.cause = RESULT_UNEXPECTED;
+    return false;
+}
 
-        char * token = strtok(_buffer, "\n");
-        if (token)
+void QuectelBC660::completeSequenceSends()
+{
+    // Queued UDP sends only report a count of failures, it is set on the last send step of the batch
+    if (_sequenceUDPStep != 0xFF)
+    {
+        if (waitForUDPSent() > 0)
+        {
+            resultStruct failure = {RESULT_ERROR, -1, -1, true, false};
+            setStepFailed(_sequenceUDPStep, &failure);
+        }
+        _sequenceUDPStep = 0xFF;
+    }
+#if QUECTEL_BC660_MQTT
+    // QoS 1/2 publishes, failed messages are set on their steps by checkURC()
+    bool pending = false;
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        pending |= _sequenceMsgIDs[i] != 0;
+    }
+    if (!pending)
+    {
+        return;
+    }
+    waitForMQTTPublished((uint32_t)_mqttPacketTimeout * (_mqttRetryTimes + 1) * 1000);
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+    {
+        if (_sequenceMsgIDs[i] != 0)
         {
-            strcpy(engineeringData.firmwareVersion, token + 10);
+            resultStruct failure = {RESULT_TIMEOUT, -1, -1, true, false};
+            setStepFailed(_sequenceMsgSteps[i], &failure);
+            _sequenceMsgIDs[i] = 0;
         }
     }
+#endif
+}
 
-    // Date and time
-    // Response: +CCLK: <time>
-    // Time: String type. The format is "YY/MM/DD,hh:mm:ss±zz", where characters indicate
-    // year (two last digits), month, day, hour, minute, second and time zone (indicates
-    // the difference, expressed in quarters of an hour, between the local time and GMT;
-    // the range is -96 to +96.) For instance, 6th of May 2014, 22:10:00 GMT+2 hours
-    // equals "14/05/06,22:10:00+08"
+void QuectelBC660::setStepFailed(uint8_t index, const resultStruct* result)
+{
+    if (index < _sequenceFailed)
+    {
+        _sequenceFailed = index;
+    }
+    if (_sequenceResults)
+    {
+        _sequenceResults[index].succeeded = false;
+        _sequenceResults[index].result = *result;
+    }
+}
 
-	// Reply is:
-    // +CCLK: 20/11/03,06:25:06+32
-    // 
-    // OK
-    wakeUp();
-    if (sendAndWaitForReply("AT+CCLK?", 1000, 3))
+// Unsolicited result codes
+void QuectelBC660::loop()
+{
+    // Collect complete lines received outside of a command exchange and pass them to the URC handler
+    while (_uart->available())
     {
-        char * token1 = strtok(_buffer, "\n");
-        if(token1)
+        char c = _uart->read();
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n' || _urcIndex >= sizeof(_urcBuffer) - 1)
         {
-            char test[3];
-            strcpy(test, token1 + 24);
-            char sign[1];
-            sign[0] = test[0];
-            char timezone[2];
-            // strcpy(sign, token + 24);
-            strcpy(timezone, test + 1);
-            if(strcmp(sign, "+"))
+            _urcBuffer[_urcIndex] = 0;
+            if (_urcIndex > 0)
             {
-                char* ptr;
-                engineeringData.timezone = strtol(timezone, &ptr, 10)/4;
+                checkURC(_urcBuffer);
             }
-            else
+            _urcIndex = 0;
+            continue;
+        }
+        _urcBuffer[_urcIndex++] = c;
+    }
+}
+
+void QuectelBC660::checkURC(const char* text)
+{
+#if QUECTEL_BC660_MQTT
+    // +QMTPUB: <TCP_connectID>,<msgID>,<result>[,<value>] for queued QoS 1/2 messages
+    const char* pub = text;
+    while ((pub = strstr(pub, "+QMTPUB:")) != nullptr)
+    {
+        uint8_t id, result;
+        uint16_t msgID;
+        if (sscanf(pub, "+QMTPUB: %hhu,%hu,%hhu", &id, &msgID, &result) == 3 && msgID != 0)
+        {
+            for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
             {
-                char* ptr;
-                engineeringData.timezone = 0 - strtol(timezone, &ptr, 10)/4;
+                if (_mqttInFlight[i] != msgID)
+                {
+                    continue;
+                }
+                if (result == 1)
+                {
+                    mqttStats.retransmissions++;
+                    break;
+                }
+                _mqttInFlight[i] = 0;
+                for (uint8_t j = 0; j < MQTT_INFLIGHT_WINDOW; j++)
+                {
+                    if (_sequenceMsgIDs[j] == msgID)
+                    {
+                        if (result != 0)
+                        {
+                            resultStruct failure = {RESULT_STAT_ERROR, -1, result, true, false};
+                            setStepFailed(_sequenceMsgSteps[j], &failure);
+                        }
+                        _sequenceMsgIDs[j] = 0;
+                    }
+                }
+                if (result == 0)
+                {
+                    mqttStats.delivered++;
+                }
+                else
+                {
+                    mqttStats.failed++;
+                }
+                if (_mqttPublishCallback)
+                {
+                    _mqttPublishCallback(msgID, result);
+                }
+                break;
             }
         }
-        char * token = strtok(_buffer, " ");
-        token = strtok(nullptr, "/");
-        if (token)
+        pub += 8;
+    }
+#endif
+
+    // Completion of pipelined UDP sends: SEND OK or SEND FAIL for each accepted command
+    if (_udpInFlight > 0)
+    {
+        const char* result = text;
+        while (_udpInFlight > 0 && (result = strstr(result, "SEND OK")) != nullptr)
+        {
+            _udpInFlight--;
+            result += 7;
+        }
+        result = text;
+        while (_udpInFlight > 0 && (result = strstr(result, "SEND FAIL")) != nullptr)
         {
-            char* ptr;
-            t.tm_year = 100 + strtol(token, &ptr, 10); // +100 because we have only two last digits -> 2000 + xx = 20xx but we must substract 1900 for epoch time
+            _udpInFlight--;
+            _udpSendFailed++;
+            result += 9;
         }
-        token = strtok(nullptr, "/");
-        if(token)
+    }
+
+    // +QIURC: "recv",<connectID>
+    if (strstr(text, "+QIURC: \"recv\""))
+    {
+        _udpDataPending = true;
+        _udpDataTime = millis();
+    }
+
+    // +CTZEU: "+32",0,"2023/05/10,08:01:02"
+    const char* urc = strstr(text, "+CTZEU:");
+    if (urc)
+    {
+        urc += 7;
+        while (*urc == ' ' || *urc == '"')
         {
-            char* ptr;
-            t.tm_mon = strtol(token, &ptr, 10) - 1;
+            urc++;
         }
-        token = strtok(nullptr, ",");
-        if(token)
+        int16_t timezone = atoi(urc + 1);
+        if (*urc == '-')
         {
-            char* ptr;
-            t.tm_mday = strtol(token, &ptr, 10);
+            timezone = -timezone;
         }
-        token = strtok(nullptr, ":");
-        if(token)
+        const char* utime = strchr(urc, ',');
+        if (utime)
         {
-            char* ptr;
-            t.tm_hour = strtol(token, &ptr, 10) - engineeringData.timezone;
+            utime = strchr(utime + 1, ',');
         }
-        token = strtok(nullptr, ":");
-        if(token)
+        time_t epoch;
+        int16_t ignored;
+        if (utime && parseDateTime(utime + 1, &epoch, &ignored))
         {
-            char* ptr;
-            t.tm_min = strtol(token, &ptr, 10);
+            setClock(epoch, timezone);
         }
-        token = strtok(nullptr, "+-");
-        if(token)
+        else
         {
-            char* ptr;
-            t.tm_sec = strtol(token, &ptr, 10);
+            _timezone = timezone;
         }
-        engineeringData.epoch = mktime(&t);
     }
+}
 
-    
+// Replay management functions
+void QuectelBC660::beginCommand()
+{
+    // Complete pipelined sends first so their completions are not mixed into the next reply (except
+    // for the next pipelined send), failures are kept for waitForUDPSent().
+    // Then process URCs received since the last command.
+    if (_udpInFlight > 0 && !_udpQueueing)
+    {
+        collectUDPSent(FIVE_SEC);
+    }
+    loop();
+    _urcIndex = 0;
+    _lastResult.cause = RESULT_OK;
+    _lastResult.errorCode = -1;
+    _lastResult.statCode = -1;
+    _lastResult.transient = false;
+    _lastResult.truncated = false;
+}
 
+void QuectelBC660::writeHex(const uint8_t* data, uint16_t dataLen)
+{
+    const char* digits = "0123456789ABCDEF";
+    for (uint16_t i = 0; i < dataLen; i++)
+    {
+        _uart->write(digits[data[i] >> 4]);
+        _uart->write(digits[data[i] & 0x0F]);
+    }
 }
 
-// Replay management functions
 bool QuectelBC660::sendAndWaitForReply(const char* command, uint32_t timeout, uint8_t lines)
 {
-    flush();
+    beginCommand();
+    timeout = adaptTimeout(command, timeout);
 	if(_debug != false){
-        Serial.print("\n --> ");
-        Serial.println(command);
+        _debugStream->print("\n --> ");
+        _debugStream->println(command);
     }
     _uart->println(command);
     return readReply(timeout, lines);
 }
 
+bool QuectelBC660::sendHexAndWaitForReply(const char* prefix, const uint8_t* data, uint16_t dataLen, const char* suffix, uint32_t timeout, uint8_t lines)
+{
+    // Command is written in parts, data is hex encoded, so the command does not have to fit into _buffer
+    beginCommand();
+    timeout = adaptTimeout(prefix, timeout);
+	if(_debug != false){
+        _debugStream->print("\n --> ");
+        _debugStream->print(prefix);
+        _debugStream->print("<");
+        _debugStream->print(dataLen);
+        _debugStream->print(" B hex>");
+        _debugStream->println(suffix);
+    }
+    _uart->print(prefix);
+    writeHex(data, dataLen);
+    _uart->println(suffix);
+    return readReply(timeout, lines);
+}
+
 bool QuectelBC660::sendAndWaitFor(const char* command, const char* reply, uint32_t timeout)
 {
     uint16_t index = 0;
 
-    flush();
+    beginCommand();
+    timeout = adaptTimeout(command, timeout);
 	if(_debug != false){
-        Serial.print("\n --> ");
-        Serial.println(command);
+        _debugStream->print("\n --> ");
+        _debugStream->println(command);
     }
     _uart->println(command);
+    _buffer[0] = 0;
     while (timeout--)
     {
-        if (index > 254)
+        if (index >= sizeof(_buffer) - 1)
         {
+            // Reply does not fit, the rest stays in the UART and is dropped as unknown URC lines
+            _lastResult.truncated = true;
+            if(_debug != false){
+            _debugStream->println(" <-- (Truncated)");
+            }
             break;
         }
         while (_uart->available())
@@ -869,20 +3805,37 @@ bool QuectelBC660::sendAndWaitFor(const char* command, const char* reply, uint32
                 continue;
             }
             _buffer[index++] = c;
+            _buffer[index] = 0;
+            if (index >= sizeof(_buffer) - 1)
+            {
+                break;
+            }
         }
 
-        if (strstr(_buffer, reply))
+        if (index > 0 && strstr(_buffer, reply))
         {
             if(_debug != false){
-            Serial.println("Match found");
+            _debugStream->println("Match found");
             }
+            recordLatency(true);
             break;
         }
+        if (index > 0 && checkError(_buffer))
+        {
+            if(_debug != false){
+            _debugStream->print(" <-- (Error) ");
+            _debugStream->println(_buffer);
+            }
+            return false;
+        }
         if (timeout <= 0)
         {
+            _lastResult.cause = RESULT_TIMEOUT;
+            _lastResult.transient = true;
+            recordLatency(false);
             if(_debug != false){
-            Serial.print(" <-- (Timeout) ");
-            Serial.println(_buffer);
+            _debugStream->print(" <-- (Timeout) ");
+            _debugStream->println(_buffer);
             }
             return false;
         }
@@ -890,27 +3843,44 @@ bool QuectelBC660::sendAndWaitFor(const char* command, const char* reply, uint32
     }
     _buffer[index] = 0;
     if(_debug != false){
-        Serial.print(" <-- ");
-        Serial.println(_buffer);
+        _debugStream->print(" <-- ");
+        _debugStream->println(_buffer);
     }
+    checkURC(_buffer);
     return true;
 }
 
 bool QuectelBC660::sendAndCheckReply(const char* command, const char* reply, uint32_t timeout)
 {
     sendAndWaitForReply(command, timeout);
-    return (strstr(_buffer, reply) != nullptr);
+    if (strstr(_buffer, reply) != nullptr)
+    {
+        return true;
+    }
+    if (_lastResult.cause == RESULT_OK)
+    {
+        _lastResult.cause = RESULT_UNEXPECTED;
+        _lastResult.transient = true;
+    }
+    return false;
 }
 
 bool QuectelBC660::readReply(uint32_t timeout, uint8_t lines)
 {
     uint16_t index = 0;
     uint16_t linesFound = 0;
+    uint16_t lineStart = 0;
+    bool error = false;
 
     while (timeout--)
     {
-	if (index > 254)
+	if (index >= sizeof(_buffer) - 1)
 	{
+	    // Reply does not fit, the rest stays in the UART and is dropped as unknown URC lines
+	    _lastResult.truncated = true;
+	    if(_debug != false){
+	    _debugStream->println(" <-- (Truncated)");
+	    }
 	    break;
 	}
 	while (_uart->available())
@@ -929,23 +3899,31 @@ bool QuectelBC660::readReply(uint32_t timeout, uint8_t lines)
 	    if (c == '\n')
 	    {
 		linesFound++;
+		// Stop at an error line, the remaining lines will not come
+		_buffer[index] = 0;
+		error = checkError(_buffer + lineStart);
+		lineStart = index;
 	    }
-	    if (linesFound >= lines)
+	    if (linesFound >= lines || error || index >= sizeof(_buffer) - 1)
 	    {
 		break;
 	    }
 	}
 
-	if (linesFound >=lines)
+	if (linesFound >= lines || error)
 	{
 	    break;
 	}
 
 	if (timeout <= 0)
 	{
+        _buffer[index] = 0;
+        _lastResult.cause = RESULT_TIMEOUT;
+        _lastResult.transient = true;
+        recordLatency(false);
         if(_debug != false){
-        Serial.print(" <-- (Timeout) ");
-        Serial.println(_buffer);
+        _debugStream->print(" <-- (Timeout) ");
+        _debugStream->println(_buffer);
         }
 	    return false;
 	}
@@ -953,10 +3931,77 @@ bool QuectelBC660::readReply(uint32_t timeout, uint8_t lines)
     }
     _buffer[index] = 0;
     if(_debug != false){
-        Serial.print(" <-- ");
-        Serial.println(_buffer);
+        _debugStream->print(" <-- ");
+        _debugStream->println(_buffer);
     }
-    return true;
+    checkURC(_buffer);
+    if (!error)
+    {
+        recordLatency(true);
+    }
+    return !error;
+}
+
+bool QuectelBC660::commandFits(int length)
+{
+    // Length returned by snprintf() of a command into _buffer, a cut command must not be sent
+    if (length >= 0 && length < (int)sizeof(_buffer))
+    {
+        return true;
+    }
+    _lastResult = {RESULT_ERROR, -1, -1, false, true};
+    if(_debug != false)
+    {
+        _debugStream->println("\nCommand does not fit into the buffer");
+    }
+    return false;
+}
+
+bool QuectelBC660::checkError(const char* text)
+{
+    // Detects ERROR or +CME ERROR: <err> in the reply and records it as result of the command
+    const char* cme = strstr(text, "+CME ERROR:");
+    if (cme)
+    {
+        _lastResult.cause = RESULT_CME_ERROR;
+        _lastResult.errorCode = atoi(cme + 11);
+        _lastResult.transient = isTransientError(_lastResult.errorCode);
+        return true;
+    }
+    const char* error = strstr(text, _ERROR);
+    if (error && (error == text || error[-1] == '\n') && (error[5] == '\n' || error[5] == 0))
+    {
+        _lastResult.cause = RESULT_ERROR;
+        _lastResult.transient = false;
+        return true;
+    }
+    return false;
+}
+
+bool QuectelBC660::isTransientError(int16_t errorCode)
+{
+    // Error codes that are expected to clear when the operation is repeated later:
+    // 30 = no network service, 100 = unknown, 551 = operation blocked, 553 = memory not enough,
+    // 558/559 = socket write/read failed, 561 = open PDP context failed, 564 = DNS busy,
+    // 566 = socket connect failed, 567 = socket closed, 568 = operation busy, 569 = operation timeout,
+    // 570 = PDP context broken down, 574 = port busy.
+    // Everything else (invalid parameters, not supported, not allowed, APN not configured, ...) is permanent.
+    static const int16_t transient[] = {30, 100, 551, 553, 558, 559, 561, 564, 566, 567, 568, 569, 570, 574};
+    for (uint8_t i = 0; i < sizeof(transient) / sizeof(transient[0]); i++)
+    {
+        if (transient[i] == errorCode)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void QuectelBC660::setStatResult(int16_t statCode, bool transient)
+{
+    _lastResult.cause = RESULT_STAT_ERROR;
+    _lastResult.statCode = statCode;
+    _lastResult.transient = transient;
 }
 
 // Flush serial buffer
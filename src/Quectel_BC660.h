@@ -2,6 +2,7 @@
 #define __Quectel_BC660_h__
 
 #include "Arduino.h"
+#include "Quectel_BC660_config.h"
 
 #define NOT -1
 #define ONE_SEC 1000
@@ -9,6 +10,76 @@
 #define ONE_MIN 60000
 #define FIVE_MIN 300000
 #define TEN_MIN 600000
+#define ONE_HOUR 3600000
+
+// Result causes (getLastResult())
+#define RESULT_OK 0
+#define RESULT_TIMEOUT 1            // Reply did not arrive in time
+#define RESULT_ERROR 2              // Module replied ERROR
+#define RESULT_CME_ERROR 3          // Module replied +CME ERROR: <err>, code in errorCode
+#define RESULT_STAT_ERROR 4         // Command accepted but operation failed, MQTT/socket result in statCode
+#define RESULT_UNEXPECTED 5         // Reply did not contain the expected response
+
+// Number of commands with learned latency (AT+QIOPEN, AT+QMTOPEN, AT+QMTCONN, AT+QMTCLOSE, AT+COPS=0)
+#define LATENCY_CLASSES 5
+
+// Release Assistance Indication, tells the network what traffic follows the uplink
+#define RAI_NONE 0          // No information, RRC connection released by the network inactivity timer
+#define RAI_NO_REPLY 1      // No further uplink or downlink data expected, release right after the uplink
+#define RAI_ONE_REPLY 2     // Only a single downlink packet (e.g. PUBACK or UDP reply) expected, release after it
+
+// Number of sleep controller decisions kept in sleepLog
+#define SLEEP_LOG_SIZE 8
+
+// Number of bands kept in the band history and longest band list for setManualBand()
+#define BAND_HISTORY_SIZE 8
+#define BAND_LIST_SIZE 24
+
+// Number of host names kept in the DNS cache
+#define DNS_CACHE_SIZE 2
+
+// Command sequence step actions and run conditions (runSequence())
+#define SEQUENCE_SLEEP 0            // value = AT+QSCLK mode
+#define SEQUENCE_OPEN_MQTT 1        // text = host, value = port
+#define SEQUENCE_CONNECT_MQTT 2     // text = client ID
+#define SEQUENCE_PUBLISH_MQTT 3     // text = topic, data, value = length, option = QoS
+#define SEQUENCE_CLOSE_MQTT 4
+#define SEQUENCE_OPEN_UDP 5         // text = host, value = port
+#define SEQUENCE_SEND_UDP 6         // data, value = length, option = RAI
+#define SEQUENCE_CLOSE_UDP 7
+#define SEQUENCE_ON_SUCCESS 0       // Step runs while all previous steps succeeded
+#define SEQUENCE_ON_FAILURE 1       // Rollback step, runs only after a step failed
+#define SEQUENCE_ALWAYS 2           // Cleanup step, runs in both cases
+
+// UDP send modes and number of datagrams in flight for queueDataUDP()
+#define UDP_SEND_PROMPT 0
+#define UDP_SEND_INLINE 1
+#define UDP_PIPELINE_DEPTH 4
+
+// MQTT connection states (AT+QMTCONN?)
+#define MQTT_STATE_CLOSED 0
+#define MQTT_STATE_INITIALIZING 1
+#define MQTT_STATE_CONNECTING 2
+#define MQTT_STATE_CONNECTED 3
+#define MQTT_STATE_DISCONNECTING 4
+
+// Number of QoS 1/2 messages in flight for publishMQTTAsync()
+#define MQTT_INFLIGHT_WINDOW 8
+
+// Payload compression frame types and maximum compressed frame size
+#define COMPRESSION_COMPRESSED 'Z'
+#define COMPRESSION_STORED 'R'
+#define COMPRESSION_BUFFER_SIZE 256
+
+// CoAP message types and request methods
+#define COAP_CON 0
+#define COAP_NON 1
+#define COAP_ACK 2
+#define COAP_RST 3
+#define COAP_GET 1
+#define COAP_POST 2
+#define COAP_PUT 3
+#define COAP_DELETE 4
 
 
 class QuectelBC660 {
@@ -18,6 +89,7 @@ class QuectelBC660 {
 
         // Initialization (only HardwareSerial is supported for now)
         bool begin(HardwareSerial *uart);
+        void setDebugStream(Print* stream);
 
         // Status and information
         const char* getFirmwareVersion();
@@ -29,10 +101,91 @@ class QuectelBC660 {
         bool setDeepSleep(uint8_t sleepMode = 0);
         bool wakeUp();
 
+        // Local time service (synced from +CCLK or +CTZEU URC, then served from millis())
+        bool syncClock();
+        void setClockResyncInterval(uint32_t resyncInterval = ONE_HOUR);
+        bool setNetworkTimeURC(bool enable = true);
+        time_t getEpoch();
+        time_t getLocalEpoch();
+        int16_t getTimezone();
+
+        // Structured result of the last command and retry policy for transient failures
+        struct resultStruct
+        {
+            uint8_t cause;              // RESULT_xxx
+            int16_t errorCode;          // +CME ERROR code, -1 if none
+            int16_t statCode;           // MQTT/socket stat or result code, -1 if none
+            bool transient;             // Failure is expected to clear when retried
+            bool truncated;             // Reply or command did not fit into the buffer (QUECTEL_BC660_BUFFER_SIZE)
+        };
+        resultStruct getLastResult();
+        void setRetryPolicy(uint8_t maxAttempts = 3, uint32_t baseDelay = ONE_SEC, uint32_t maxDelay = ONE_MIN, uint8_t jitter = 50);
+        bool retryAfterFailure(uint8_t attempt);
+
+#if QUECTEL_BC660_ADAPTIVE_TIMEOUTS
+        // Adaptive per-command timeouts learned from observed latency
+        struct latencyStruct
+        {
+            uint32_t average;           // EWMA of the reply latency [ms]
+            uint32_t deviation;         // EWMA of the latency mean deviation [ms]
+            uint16_t samples;
+            uint16_t timeouts;
+        };
+        void setAdaptiveTimeouts(bool enable = true, uint32_t floor = 500, uint32_t ceiling = FIVE_MIN);
+        void setLatencyStore(latencyStruct* store);
+#endif
+
+        // Command sequences (whole duty cycle as one transaction: single wake, pipelined sends, abort and rollback)
+        struct sequenceStep
+        {
+            uint8_t action;             // SEQUENCE_xxx
+            const char* text;
+            const char* data;
+            uint16_t value;
+            uint8_t option;
+            uint8_t run;                // SEQUENCE_ON_SUCCESS, SEQUENCE_ON_FAILURE or SEQUENCE_ALWAYS
+        };
+        struct stepResultStruct
+        {
+            bool executed;
+            bool succeeded;
+            resultStruct result;
+            uint32_t duration;          // [ms], for pipelined sends until the command was accepted
+        };
+        uint8_t runSequence(const sequenceStep* steps, uint8_t numOfSteps, stepResultStruct* results = nullptr);
+
+        // Unsolicited result codes (call regularly to process URCs received between commands)
+        void loop();
+
         // eDRX and PSM timers
         const char* getPSM();
         bool setPSM(const char* requested_periodic_TAU, const char* requested_active_time, uint8_t mode = 1);
 
+#if QUECTEL_BC660_SLEEP_CONTROL
+        // Sleep controller (chooses AT+QSCLK mode from the time to the next send and the granted PSM timers)
+        bool updateGrantedPSM();
+        uint32_t getGrantedActiveTime();
+        uint32_t getGrantedTAU();
+        uint8_t planSleep(uint32_t nextSend, uint32_t maxWakeLatency = FIVE_SEC);
+        struct sleepDecisionStruct
+        {
+            uint32_t time;              // millis() of the decision
+            uint32_t nextSend;          // Time to the next send [ms]
+            uint8_t mode;               // Chosen AT+QSCLK mode
+            bool changed;               // AT+QSCLK was sent
+            uint32_t charge;            // Estimated module charge until the next send [uA*s]
+        };
+        sleepDecisionStruct sleepLog[SLEEP_LOG_SIZE] = {};
+        struct sleepStatsStruct
+        {
+            uint32_t decisions;
+            uint32_t modes[3];          // Decisions per AT+QSCLK mode
+            uint32_t skippedCommands;   // AT+QSCLK commands not sent because the mode did not change
+            uint32_t failedCommands;    // AT+QSCLK commands the module did not accept, the decision is not logged
+        };
+        sleepStatsStruct sleepStats = {};
+#endif
+
         // Network
         bool setDefaultAPN(const char* PDP_type, const char* APN, const char* username = "", const char* password = "", uint8_t auth_type = 0, uint32_t timeout = FIVE_MIN);
         bool getRegistrationStatus(uint8_t noOfTries = 1, uint32_t delayBetweenTries = FIVE_SEC);
@@ -41,41 +194,271 @@ class QuectelBC660 {
         bool manualRegisterToNetwork(const char* oper, uint8_t mode = 4, uint8_t format = 2, uint32_t timeout = FIVE_MIN);
         bool setAutoBand(bool deregistred = true, uint32_t timeout = FIVE_MIN);
         bool setManualBand(uint8_t numOfBands, uint8_t *bands, bool deregistred = true, uint32_t timeout = FIVE_MIN);
+#if QUECTEL_BC660_ENGINEERING
+        // Fast attach on the cached band, EARFCN and PLMN of the last attach, full scan as fallback
+        struct attachCacheStruct
+        {
+            uint8_t band;               // 0 = nothing cached yet
+            uint32_t EARFCN;
+            int8_t EARFCNOffset;
+            char PLMN[7];               // MCC and MNC, numeric format
+            uint32_t fastAttaches;      // Attaches on the cached cell
+            uint32_t fastFailures;      // Cached cell not found, full scan followed
+            uint32_t fullScans;         // Attaches by full scan
+            uint32_t fastAttachTime;    // Total time of fast attaches [ms]
+            uint32_t fullScanTime;      // Total time of full scan attaches [ms]
+        };
+        void setAttachCacheStore(attachCacheStruct* cache);
+        bool attachToNetwork(uint32_t timeout = ONE_MIN, uint32_t fallbackTimeout = FIVE_MIN, bool lockBand = false);
+
+        // Band order for setManualBand() learned from registration history (expected attach time per band)
+        struct bandHistoryStruct
+        {
+            uint8_t band;               // 0 = unused entry
+            uint16_t attempts;
+            uint16_t successes;
+            uint32_t averageTime;       // EWMA of successful attach time [ms]
+        };
+        void setBandLearning(bool enable = true);
+        void setBandHistoryStore(bandHistoryStruct* history);
+        void orderBands(uint8_t numOfBands, uint8_t* bands);
+#endif
         
         
+#if QUECTEL_BC660_DNS_CACHE
+        // DNS cache for openMQTT() and openUDP() host names (AT+QIDNSGIP, expiry from the DNS TTL)
+        struct dnsCacheStruct
+        {
+            uint32_t hostHash;          // 0 = unused entry
+            char IP[40];
+            time_t expires;             // UTC epoch, 0 = not known (clock was not synced)
+        };
+        void setDNSCache(bool enable = true);
+        void setDNSCacheStore(dnsCacheStruct* cache);
+        const char* resolveHost(const char* host);
+        void invalidateHost(const char* host);
+        struct dnsStatsStruct
+        {
+            uint32_t hits;
+            uint32_t misses;
+            uint32_t failures;          // Failed AT+QIDNSGIP queries
+            uint32_t reresolutions;     // Cached address failed to open and was resolved again
+        };
+        dnsStatsStruct dnsStats = {};
+#endif
+
+#if QUECTEL_BC660_MQTT
         // MQTT
         bool openMQTT(const char* host, uint16_t port = 1883, uint8_t TCPconnectID = 0);
         bool closeMQTT();
         bool connectMQTT(const char* clientID);
-        bool publishMQTT(const char* msg, uint16_t msgLen, const char* topic, uint16_t msgID = 0, uint8_t QoS = 0, uint8_t retain = 0);
+        bool setMQTTKeepAlive(uint16_t keepAlive = 120, uint8_t TCPconnectID = 0);
+        bool setMQTTSession(bool cleanSession = false, uint32_t sessionExpiry = 0, uint8_t TCPconnectID = 0);
+        bool setMQTTWill(const char* topic, const char* msg = "", uint8_t QoS = 0, uint8_t retain = 0, uint8_t TCPconnectID = 0);
+        bool ensureMQTTConnected(const char* host, uint16_t port, const char* clientID, uint8_t TCPconnectID = 0);
+        uint8_t getMQTTState();
+        bool isMQTTSessionResumed();
+        struct mqttSessionStruct
+        {
+            time_t lastActivity;        // UTC epoch of the last successful connect or publish
+            uint32_t reused;            // Wakes that found the connection still up
+            uint32_t reconnected;       // Wakes that only needed AT+QMTCONN
+            uint32_t reopened;          // Wakes that needed AT+QMTOPEN and AT+QMTCONN
+        };
+        void setMQTTSessionStore(mqttSessionStruct* session);
+        bool publishMQTT(const char* msg, uint16_t msgLen, const char* topic, uint16_t msgID = 0, uint8_t QoS = 0, uint8_t retain = 0, bool compressed = false, uint8_t RAI = RAI_NONE);
+        bool publishMQTTAsync(const char* msg, uint16_t msgLen, const char* topic, uint8_t QoS = 1, uint8_t retain = 0, uint16_t* msgID = nullptr);
+        void setMQTTPublishCallback(void (*callback)(uint16_t msgID, uint8_t result));
+        bool setMQTTRetransmission(uint8_t packetTimeout = 10, uint8_t retryTimes = 3);
+        uint8_t getMQTTInFlight();
+        uint8_t waitForMQTTPublished(uint32_t timeout = ONE_MIN);
+        struct mqttStatsStruct
+        {
+            uint32_t published;         // Messages accepted by publishMQTTAsync()
+            uint32_t delivered;         // Queued messages acknowledged by the broker
+            uint32_t failed;            // Queued messages failed after all retransmissions
+            uint32_t retransmissions;   // Retransmissions reported by the module
+        };
+        mqttStatsStruct mqttStats = {};
+#endif
 
         // UDP socket
         bool openUDP(const char* host, uint16_t port, uint8_t TCPconnectID = 0);
         bool closeUDP();
-        bool sendDataUDP(const char* msg, uint16_t msgLen);
+        bool sendDataUDP(const char* msg, uint16_t msgLen, uint8_t RAI = RAI_NONE);
+        int16_t receiveDataUDP(uint8_t* data, uint16_t maxLen, uint32_t timeout = ONE_SEC);
+#if QUECTEL_BC660_COMPRESSION
+        void setUDPCompression(bool enable = true);
+#endif
+        void setUDPSendMode(uint8_t mode = UDP_SEND_INLINE);
+        bool queueDataUDP(const char* msg, uint16_t msgLen, uint8_t RAI = RAI_NONE);
+        uint8_t waitForUDPSent(uint32_t timeout = FIVE_SEC);
+        uint8_t getUDPInFlight();
+
+#if QUECTEL_BC660_COMPRESSION
+        // Payload compression (LZSS frames, see compress() for the frame format)
+        uint16_t compress(const uint8_t* in, uint16_t inLen, uint8_t* out, uint16_t outSize);
+        static int16_t decompress(const uint8_t* in, uint16_t inLen, uint8_t* out, uint16_t outSize);
+        float getCompressionRatio();
+        struct compressionStatsStruct
+        {
+            uint32_t messages;          // Messages passed through the compressor
+            uint32_t inputBytes;        // Bytes before compression
+            uint32_t outputBytes;       // Bytes sent (compressed or stored frames)
+            uint32_t cpuTime;           // Total time spent compressing [us]
+        };
+        compressionStatsStruct compressionStats = {};
+#endif
+
+#if QUECTEL_BC660_COAP
+        // CoAP client over the UDP socket (CON/NON, retransmission with exponential backoff, block-wise transfer)
+        int16_t coapRequest(uint8_t method, const char* path, const uint8_t* payload, uint16_t payloadLen, uint8_t* response, uint16_t responseSize, bool confirmable = true, int16_t contentFormat = -1);
+        void setCoAPRetransmission(uint32_t ackTimeout = 2000, uint8_t maxRetransmit = 4);
+        uint8_t getCoAPResponseCode();
+#endif
+
+#if QUECTEL_BC660_ENGINEERING
+        // Coverage-aware scheduling (defers non-urgent sends until RSRP/SINR/ECL improve or deadline expires)
+        void setCoverageThresholds(int16_t minRSRP = -110, int8_t minSINR = 0, uint8_t maxECL = 0, uint32_t checkInterval = FIVE_SEC);
+        bool waitForCoverage(uint32_t deadline, uint16_t msgLen = 0);
+        bool sendDataUDPScheduled(const char* msg, uint16_t msgLen, uint32_t deadline = FIVE_MIN, uint8_t RAI = RAI_NONE);
+#if QUECTEL_BC660_MQTT
+        bool publishMQTTScheduled(const char* msg, uint16_t msgLen, const char* topic, uint32_t deadline = FIVE_MIN, uint16_t msgID = 0, uint8_t QoS = 0, uint8_t retain = 0, bool compressed = false, uint8_t RAI = RAI_NONE);
+#endif
+        struct coverageStatsStruct
+        {
+            uint32_t scheduledSends;    // Sends that went through the scheduler
+            uint32_t deferredSends;     // Sends that were held back at least once
+            uint32_t expiredDeadlines;  // Sends transmitted because the deadline expired
+            uint32_t deferredTime;      // Total time spent waiting for better coverage [ms]
+            uint32_t savedAirtime;      // Estimated radio time saved by deferring [ms]
+        };
+        coverageStatsStruct coverageStats = {};
 
         // Engineering data
         struct engineeringStruct
         {
-            int8_t RSRP;
+            int16_t RSRP;
             int8_t RSRQ;
             int8_t RSSI;
             int8_t SINR;
+            uint8_t ECL;
+            uint32_t EARFCN;
+            int8_t EARFCNOffset;
+            uint16_t PCI;
+            uint8_t band;
             char firmwareVersion[20];
             time_t epoch;
             int16_t timezone;
         };
         engineeringStruct engineeringData;
         void getData();
+#endif
+
+#if QUECTEL_BC660_LINK_HEALTH
+        // Link health monitor (RTT, jitter and loss to the backend from AT+QPING and UDP echo probes)
+        struct linkHealthStruct
+        {
+            uint32_t probes;
+            uint32_t lost;
+            uint32_t lastRTT;           // [ms]
+            uint32_t averageRTT;        // EWMA of the RTT [ms]
+            uint32_t minRTT;            // [ms]
+            uint32_t maxRTT;            // [ms]
+            uint32_t jitter;            // Interarrival jitter as in RFC 3550 [ms]
+            uint32_t lossHistory;       // Last 32 probes, bit set = lost, bit 0 is the newest
+            uint16_t loss;              // Loss over the last 32 probes [per mille]
+            uint32_t lastProbe;         // millis() of the last probe
+#if QUECTEL_BC660_ENGINEERING
+            int16_t RSRP;               // Serving cell at the last probe
+            int8_t SINR;
+            uint8_t ECL;
+#endif
+        };
+        bool pingHost(const char* host, uint8_t count = 4, uint8_t timeout = 4);
+        bool probeUDPEcho(uint8_t count = 4, uint32_t timeout = FIVE_SEC);
+        void resetLinkHealth();
+        linkHealthStruct pingStats = {};
+        linkHealthStruct echoStats = {};
+#endif
 
         // Flush the serial buffer
         void flush();
     private:
         // Reply management
+        void beginCommand();
+        void writeHex(const uint8_t* data, uint16_t dataLen);
         bool sendAndWaitForReply(const char* command, uint32_t timeout = ONE_SEC, uint8_t lines = 1);
         bool sendAndWaitFor(const char* command, const char* reply, uint32_t timeout); 
         bool sendAndCheckReply(const char* command, const char* reply, uint32_t timeout = ONE_SEC);
+        bool sendHexAndWaitForReply(const char* prefix, const uint8_t* data, uint16_t dataLen, const char* suffix, uint32_t timeout = ONE_SEC, uint8_t lines = 1);
         bool readReply(uint32_t timeout = ONE_SEC, uint8_t lines = 1);
+        void checkURC(const char* text);
+        bool runStep(const sequenceStep* step, uint8_t index);
+        void completeSequenceSends();
+        void setStepFailed(uint8_t index, const resultStruct* result);
+#if QUECTEL_BC660_DNS_CACHE
+        const char* lookupHost(const char* host, bool* cached);
+        const char* reresolveHost(const char* host);
+        const char* queryDNS(const char* host);
+#endif
+        bool openUDPSocket(const char* host, uint16_t port, uint8_t TCPconnectID);
+        bool writeBands(uint8_t numOfBands, uint8_t *bands, bool deregistred, uint32_t timeout);
+        bool commandFits(int length);
+        bool checkError(const char* text);
+        uint32_t adaptTimeout(const char* command, uint32_t timeout);
+        void recordLatency(bool replied);
+        bool isTransientError(int16_t errorCode);
+        void setStatResult(int16_t statCode, bool transient);
+
+#if QUECTEL_BC660_MQTT
+        bool openMQTTSocket(const char* host, uint16_t port, uint8_t TCPconnectID);
+
+        // MQTT publish helpers
+        bool sendMQTTPublish(const char* msg, uint16_t msgLen, const char* topic, uint16_t msgID, uint8_t QoS, uint8_t retain, bool compressed);
+        uint16_t nextMQTTMessageID();
+        bool mqttMessageIDInFlight(uint16_t msgID);
+        int8_t freeMQTTSlot();
+        void touchMQTTSession();
+        bool setMQTTDataFormat(bool hex);
+#endif
+
+        // UDP send, compression framing is done by sendUDP(), writeUDP() sends the frame as is
+        bool sendUDP(const char* msg, uint16_t msgLen, uint8_t RAI, bool wait);
+        bool writeUDP(uint8_t header, const uint8_t* data, uint16_t dataLen, uint8_t RAI, bool wait);
+        void collectUDPSent(uint32_t timeout);
+
+        // Release Assistance Indication for the next uplink
+        bool setRAI(uint8_t RAI);
+        void clearRAI(uint8_t RAI);
+
+#if QUECTEL_BC660_COAP
+        // CoAP helpers
+        int16_t coapTransaction(const uint8_t* msg, uint16_t msgLen, uint8_t* rx, uint16_t rxSize);
+        bool coapAddOption(uint8_t* msg, uint16_t* len, uint16_t* lastOption, uint16_t number, const uint8_t* value, uint16_t valueLen);
+        uint8_t coapUint(uint8_t* value, uint32_t number);
+#endif
+
+#if QUECTEL_BC660_LINK_HEALTH
+        // Link health helpers
+        void recordProbe(linkHealthStruct* stats, bool replied, uint32_t rtt);
+        void updateProbeRadio(linkHealthStruct* stats);
+#endif
+
+        // Time helpers
+        bool parseDateTime(const char* str, time_t* epoch, int16_t* timezone);
+        void setClock(time_t epoch, int16_t timezone);
+
+#if QUECTEL_BC660_ENGINEERING
+        // Serving cell readings (AT+QENG=0 only)
+        bool updateServingCell();
+        bool updateAttachCache();
+        bandHistoryStruct* bandEntry(uint8_t band);
+        void recordAttach(bool attached, uint32_t attachTime);
+        uint32_t expectedAttachTime(uint8_t band);
+        uint32_t estimateAirtime(uint16_t msgLen, uint8_t ECL);
+        bool coverageIsGood();
+#endif
 
         // TODO: updateSleepMode() is not working as expected yet
         void updateSleepMode();
@@ -83,17 +466,102 @@ class QuectelBC660 {
         // Private variables
         int8_t _wakeUpPin;
         bool _debug;
+        Print* _debugStream = &Serial;
         HardwareSerial *_uart;
-        uint8_t _sleepMode;
-        uint8_t _TCPconnectID;
-        char _buffer[255];
-        char _command[32];
-        char _firmwareVersion[20];
-        char _dateAndTime[40];
-        char _psm[40];
-        char _host[40];
-        uint16_t _port;
-        struct tm t = {0};
+        uint8_t _sleepMode = 0;
+        uint8_t _TCPconnectID = 0;
+#if QUECTEL_BC660_SLEEP_CONTROL
+        bool _psmChecked = false;
+        bool _psmGranted = false;
+        uint32_t _grantedActiveTime = 0;    // T3324 [s]
+        uint32_t _grantedTAU = 0;           // T3412 [s]
+#endif
+        char _buffer[QUECTEL_BC660_BUFFER_SIZE];
+#if QUECTEL_BC660_ENGINEERING
+        int16_t _minRSRP = -110;
+        int8_t _minSINR = 0;
+        uint8_t _maxECL = 0;
+        uint32_t _coverageCheckInterval = FIVE_SEC;
+        attachCacheStruct _attachCacheDefault = {};
+        attachCacheStruct* _attachCache = &_attachCacheDefault;
+        bool _bandLearning = false;
+        bandHistoryStruct _bandHistoryDefault[BAND_HISTORY_SIZE] = {};
+        bandHistoryStruct* _bandHistory = _bandHistoryDefault;
+        uint8_t _lastBands[BAND_LIST_SIZE] = {};
+        uint8_t _numOfLastBands = 0;
+        bool _bandsSet = false;             // Bands set by the application, restored by the full scan
+        uint8_t _bands[BAND_LIST_SIZE] = {};
+        uint8_t _numOfBands = 0;            // 0 = all bands (AT+QBAND=0)
+#endif
+        bool _clockSynced = false;
+        time_t _syncEpoch = 0;              // UTC epoch at last sync
+        uint32_t _syncMillis = 0;           // millis() at last sync
+        int32_t _clockDrift = 0;            // Measured MCU clock drift [ppm]
+        int16_t _timezone = 0;              // Quarters of an hour from GMT
+        uint32_t _clockResyncInterval = ONE_HOUR;
+        bool _udpDataPending = false;
+        uint32_t _udpDataTime = 0;          // millis() of the last +QIURC: "recv"
+#if QUECTEL_BC660_LINK_HEALTH
+        uint16_t _echoSequence = 0;
+#endif
+#if QUECTEL_BC660_COMPRESSION
+        bool _udpCompression = false;
+#endif
+        uint8_t _udpSendMode = UDP_SEND_PROMPT;
+        uint8_t _udpInFlight = 0;
+        uint8_t _udpSendFailed = 0;
+        bool _udpQueueing = false;
+        bool _holdAwake = false;
+        stepResultStruct* _sequenceResults = nullptr;
+        uint8_t _sequenceFailed = 0xFF;
+        uint8_t _sequenceUDPStep = 0xFF;
+        uint8_t _sequencePublishStep = 0xFF;
+#if QUECTEL_BC660_DNS_CACHE
+        bool _dnsCache = false;
+        dnsCacheStruct _dnsCacheDefault[DNS_CACHE_SIZE] = {};
+        dnsCacheStruct* _dnsCacheEntries = _dnsCacheDefault;
+#endif
+#if QUECTEL_BC660_MQTT
+        uint16_t _sequenceMsgIDs[MQTT_INFLIGHT_WINDOW] = {};
+        uint8_t _sequenceMsgSteps[MQTT_INFLIGHT_WINDOW] = {};
+        bool _mqttHexMode = false;
+        uint16_t _mqttNextMsgID = 0;
+        uint16_t _mqttInFlight[MQTT_INFLIGHT_WINDOW] = {};
+        uint8_t _mqttPacketTimeout = 10;
+        uint8_t _mqttRetryTimes = 3;
+        void (*_mqttPublishCallback)(uint16_t msgID, uint8_t result) = nullptr;
+        bool _mqttCleanSession = true;
+        uint32_t _mqttSessionExpiry = 0;
+        bool _mqttSessionResumed = false;
+        mqttSessionStruct _mqttSessionDefault = {};
+        mqttSessionStruct* _mqttSession = &_mqttSessionDefault;
+#endif
+#if QUECTEL_BC660_COAP
+        uint16_t _coapMessageID = 0;
+        uint16_t _coapToken = 0;
+        uint8_t _coapResponseCode = 0;
+        uint32_t _coapAckTimeout = 2000;
+        uint8_t _coapMaxRetransmit = 4;
+        uint16_t _coapSeen[4] = {};
+        uint8_t _coapSeenIndex = 0;
+        uint8_t _coapSeenCount = 0;
+#endif
+        resultStruct _lastResult = {RESULT_OK, -1, -1, false, false};
+        uint8_t _retryMaxAttempts = 3;
+        uint32_t _retryBaseDelay = ONE_SEC;
+        uint32_t _retryMaxDelay = ONE_MIN;
+        uint8_t _retryJitter = 50;
+#if QUECTEL_BC660_ADAPTIVE_TIMEOUTS
+        bool _adaptiveTimeouts = false;
+        uint32_t _timeoutFloor = 500;
+        uint32_t _timeoutCeiling = FIVE_MIN;
+        uint8_t _latencyClass = 0xFF;
+        uint32_t _commandStart = 0;
+        latencyStruct _latencyDefault[LATENCY_CLASSES] = {};
+        latencyStruct* _latency = _latencyDefault;
+#endif
+        char _urcBuffer[QUECTEL_BC660_URC_BUFFER_SIZE];
+        uint16_t _urcIndex = 0;
         
         // Private constants
         const char* _AT = "AT";
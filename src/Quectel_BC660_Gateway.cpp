@@ -0,0 +1,185 @@
+#include <Arduino.h>
+#include "Quectel_BC660_Gateway.h"
+
+// Constructor
+QuectelBC660Gateway::QuectelBC660Gateway(bool debug)
+{
+    _debug = debug;
+}
+
+bool QuectelBC660Gateway::addModem(QuectelBC660* modem)
+{
+    if (_numOfModems >= GATEWAY_MAX_MODEMS)
+    {
+        return false;
+    }
+    _modems[_numOfModems] = modem;
+    _status[_numOfModems] = {};
+    _numOfModems++;
+    // Query registration and signal right away so the module can be used by the first loop()
+    _nextStatus = _numOfModems - 1;
+    updateStatus();
+    return true;
+}
+
+void QuectelBC660Gateway::setDebugStream(Print* stream)
+{
+    _debugStream = stream;
+}
+
+void QuectelBC660Gateway::setStatusInterval(uint32_t interval)
+{
+    // Registration and signal of each module is queried once per interval, one module per loop() call
+    _statusInterval = interval;
+}
+
+// Outbound queue
+bool QuectelBC660Gateway::queueDataUDP(const char* msg, uint16_t msgLen, uint8_t RAI)
+{
+    if (_queueCount >= GATEWAY_QUEUE_SIZE || msgLen > GATEWAY_MESSAGE_SIZE)
+    {
+        gatewayStats.dropped++;
+        if(_debug != false)
+        {
+            _debugStream->println("\nGateway queue full or message too long, dropped");
+        }
+        return false;
+    }
+    messageStruct* message = &_queue[(_queueHead + _queueCount) % GATEWAY_QUEUE_SIZE];
+    memcpy(message->data, msg, msgLen);
+    message->len = msgLen;
+    message->RAI = RAI;
+    _queueCount++;
+    gatewayStats.queued++;
+    return true;
+}
+
+uint8_t QuectelBC660Gateway::getQueued()
+{
+    return _queueCount;
+}
+
+void QuectelBC660Gateway::loop()
+{
+    // Collect send completions and URCs of all modules, this does not block
+    for (uint8_t i = 0; i < _numOfModems; i++)
+    {
+        _modems[i]->loop();
+    }
+
+    // Refresh status of at most one module per call, so the other modules are not held up for long.
+    // A module with sends in flight is skipped, the status commands would wait for their completion.
+    if (_numOfModems > 0)
+    {
+        _nextStatus = (_nextStatus + 1) % _numOfModems;
+        if (millis() - _status[_nextStatus].lastUpdate >= _statusInterval && _modems[_nextStatus]->getUDPInFlight() == 0)
+        {
+            updateStatus();
+        }
+    }
+
+    // Hand queued datagrams to the modules while any of them has room in its send pipeline
+    while (_queueCount > 0)
+    {
+        int8_t index = selectModem();
+        if (index < 0)
+        {
+            break;
+        }
+        messageStruct* message = &_queue[_queueHead];
+        if (!_modems[index]->queueDataUDP(message->data, message->len, message->RAI))
+        {
+            // Module refused the datagram, keep it queued and check the module again
+            _status[index].lastUpdate = millis() - _statusInterval;
+            break;
+        }
+        _status[index].sent++;
+        gatewayStats.sent++;
+        _queueHead = (_queueHead + 1) % GATEWAY_QUEUE_SIZE;
+        _queueCount--;
+        if(_debug != false)
+        {
+            _debugStream->print("\nGateway: datagram sent by modem ");
+            _debugStream->println(index);
+        }
+    }
+}
+
+uint8_t QuectelBC660Gateway::flush(uint32_t timeout)
+{
+    // Send everything queued and wait for completion, returns number of datagrams that were not sent
+    uint32_t start = millis();
+    while (_queueCount > 0 && millis() - start < timeout)
+    {
+        loop();
+        if (_queueCount > 0)
+        {
+            delay(1);
+        }
+    }
+    uint8_t failed = _queueCount;
+    gatewayStats.dropped += _queueCount;
+    _queueCount = 0;
+    for (uint8_t i = 0; i < _numOfModems; i++)
+    {
+        uint32_t elapsed = millis() - start;
+        failed += _modems[i]->waitForUDPSent(elapsed < timeout ? timeout - elapsed : 0);
+    }
+    return failed;
+}
+
+QuectelBC660Gateway::modemStatusStruct QuectelBC660Gateway::getModemStatus(uint8_t index)
+{
+    if (index >= _numOfModems)
+    {
+        return {};
+    }
+    return _status[index];
+}
+
+void QuectelBC660Gateway::updateStatus()
+{
+    modemStatusStruct* status = &_status[_nextStatus];
+    status->registered = _modems[_nextStatus]->getRegistrationStatus(1, 0);
+    int8_t rssi = _modems[_nextStatus]->getRSSI();
+    // 99 = not known or not detectable
+    status->RSSI = rssi == 99 ? 0 : rssi;
+    status->lastUpdate = millis();
+    if(_debug != false)
+    {
+        _debugStream->print("\nGateway: modem ");
+        _debugStream->print(_nextStatus);
+        _debugStream->print(status->registered ? " registered, RSSI: " : " not registered, RSSI: ");
+        _debugStream->println(status->RSSI);
+    }
+}
+
+int8_t QuectelBC660Gateway::selectModem()
+{
+    // Registered module with the most free pipeline slots, equal ones are ordered by signal strength.
+    // Unknown signal (0) is treated as the weakest.
+    int8_t best = -1;
+    uint8_t bestFree = 0;
+    int16_t bestRSSI = 0;
+    for (uint8_t i = 0; i < _numOfModems; i++)
+    {
+        if (!_status[i].registered)
+        {
+            continue;
+        }
+        uint8_t inFlight = _modems[i]->getUDPInFlight();
+        if (inFlight >= UDP_PIPELINE_DEPTH)
+        {
+            continue;
+        }
+        uint8_t free = UDP_PIPELINE_DEPTH - inFlight;
+        int16_t rssi = _status[i].RSSI != 0 ? _status[i].RSSI : -128;
+        if (best < 0 || free > bestFree || (free == bestFree && rssi > bestRSSI))
+        {
+            best = i;
+            bestFree = free;
+            bestRSSI = rssi;
+        }
+    }
+    return best;
+}
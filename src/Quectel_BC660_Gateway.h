@@ -0,0 +1,67 @@
+#ifndef __Quectel_BC660_Gateway_h__
+#define __Quectel_BC660_Gateway_h__
+
+#include "Arduino.h"
+#include "Quectel_BC660.h"
+
+#define GATEWAY_MAX_MODEMS 4
+#define GATEWAY_QUEUE_SIZE 16
+#define GATEWAY_MESSAGE_SIZE 128
+
+// Several BC660 modules on separate UARTs driven from one loop. Outbound UDP datagrams are queued
+// and written to the modules with pipelined inline sends, so all modules transmit at the same time.
+class QuectelBC660Gateway {
+    public:
+        // Constructor
+        QuectelBC660Gateway(bool debug = false);
+
+        // Modules are started (begin()) and have UDP socket opened in UDP_SEND_INLINE mode before adding
+        bool addModem(QuectelBC660* modem);
+        void setDebugStream(Print* stream);
+        void setStatusInterval(uint32_t interval);
+
+        // Outbound queue, datagrams are sent by loop() on the best available module
+        bool queueDataUDP(const char* msg, uint16_t msgLen, uint8_t RAI = RAI_NONE);
+        uint8_t getQueued();
+        void loop();
+        uint8_t flush(uint32_t timeout = FIVE_SEC);
+
+        struct modemStatusStruct
+        {
+            bool registered;
+            int8_t RSSI;                // dBm, 0 when not known
+            uint32_t lastUpdate;        // millis() of the last registration and signal query
+            uint32_t sent;              // Datagrams written to the module
+        };
+        modemStatusStruct getModemStatus(uint8_t index);
+
+        struct
+        {
+            uint32_t queued;
+            uint32_t sent;
+            uint32_t dropped;           // Queue full or still queued at flush() timeout
+        } gatewayStats = {};
+
+    private:
+        struct messageStruct
+        {
+            uint16_t len;
+            uint8_t RAI;
+            char data[GATEWAY_MESSAGE_SIZE];
+        };
+        void updateStatus();
+        int8_t selectModem();
+
+        bool _debug;
+        Print* _debugStream = &Serial;
+        QuectelBC660* _modems[GATEWAY_MAX_MODEMS];
+        modemStatusStruct _status[GATEWAY_MAX_MODEMS];
+        uint8_t _numOfModems = 0;
+        uint8_t _nextStatus = 0;
+        uint32_t _statusInterval = ONE_MIN;
+        messageStruct _queue[GATEWAY_QUEUE_SIZE];
+        uint8_t _queueHead = 0;
+        uint8_t _queueCount = 0;
+};
+
+#endif
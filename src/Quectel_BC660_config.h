@@ -0,0 +1,60 @@
+#ifndef __Quectel_BC660_config_h__
+#define __Quectel_BC660_config_h__
+
+// Compile time configuration. Arduino IDE builds libraries without the sketch defines, so change the
+// values here, or pass them as build flags (e.g. PlatformIO build_flags = -DQUECTEL_BC660_MQTT=0).
+
+// Reply buffer, holds one command or its whole reply. Replies that do not fit are truncated and
+// reported in getLastResult().truncated, commands that do not fit are not sent. AT+QIRD reads and the
+// CoAP block size are sized to fit it. CoAP needs at least 120 bytes: a hex read of the smallest block
+// (16 bytes) and its 32 byte message overhead, plus 24 bytes of the +QIRD reply (see COAP_READ_SIZE).
+#ifndef QUECTEL_BC660_BUFFER_SIZE
+#define QUECTEL_BC660_BUFFER_SIZE 255
+#endif
+
+// Line buffer for URCs received between commands, longer lines are split. The longest handled URC
+// (+CTZEU with the time) is 37 characters.
+#ifndef QUECTEL_BC660_URC_BUFFER_SIZE
+#define QUECTEL_BC660_URC_BUFFER_SIZE 48
+#endif
+
+// Features, set to 0 to leave the code and its state out of the build
+#ifndef QUECTEL_BC660_MQTT
+#define QUECTEL_BC660_MQTT 1
+#endif
+
+#ifndef QUECTEL_BC660_COAP
+#define QUECTEL_BC660_COAP 1
+#endif
+
+// Engineering data (AT+QENG) and coverage-aware scheduling, which is based on it
+#ifndef QUECTEL_BC660_ENGINEERING
+#define QUECTEL_BC660_ENGINEERING 1
+#endif
+
+// Sleep controller (planSleep(), sleepLog and sleepStats)
+#ifndef QUECTEL_BC660_SLEEP_CONTROL
+#define QUECTEL_BC660_SLEEP_CONTROL 1
+#endif
+
+// DNS cache for openMQTT() and openUDP(), without it host names are passed to the module as given
+#ifndef QUECTEL_BC660_DNS_CACHE
+#define QUECTEL_BC660_DNS_CACHE 1
+#endif
+
+// Adaptive per-command timeouts (setAdaptiveTimeouts() and the latency table)
+#ifndef QUECTEL_BC660_ADAPTIVE_TIMEOUTS
+#define QUECTEL_BC660_ADAPTIVE_TIMEOUTS 1
+#endif
+
+// Payload compression for UDP and MQTT sends
+#ifndef QUECTEL_BC660_COMPRESSION
+#define QUECTEL_BC660_COMPRESSION 1
+#endif
+
+// Link health monitor (pingHost(), probeUDPEcho() and their statistics)
+#ifndef QUECTEL_BC660_LINK_HEALTH
+#define QUECTEL_BC660_LINK_HEALTH 1
+#endif
+
+#endif
@@ -32,6 +32,8 @@ void setup()
   	Serial.println(quectel.engineeringData.RSSI);
 	Serial.print("SINR: "); 
   	Serial.println(quectel.engineeringData.SINR);
+	Serial.print("ECL: "); 
+  	Serial.println(quectel.engineeringData.ECL);
 	Serial.print("Firmware: ");
 	Serial.println(quectel.engineeringData.firmwareVersion);
 	Serial.print("Epoch: ");
@@ -0,0 +1,40 @@
+#include <Quectel_BC660.h>
+
+#define SERIAL_PORT Serial2
+
+QuectelBC660 quectel = QuectelBC660(5, true);
+
+uint8_t response[256];
+
+void setup() 
+{
+	Serial.begin(115200);
+	Serial.println("Quectel CoAP client test");
+	Serial.println("===================");
+	quectel.begin(&SERIAL_PORT);
+    if(quectel.getRegistrationStatus(5))
+    {
+        Serial.println("Module is registered to network");
+    }
+    quectel.setDeepSleep();
+    Serial.println("======CoAP GET======");
+    quectel.openUDP("0.0.0.0", 5683);	// Replace 0.0.0.0 with your CoAP server IP adress
+    int16_t len = quectel.coapRequest(COAP_GET, "/test", nullptr, 0, response, sizeof(response));
+    Serial.print("Response code: ");
+    Serial.println(quectel.getCoAPResponseCode(), HEX);
+    Serial.print("Response size: ");
+    Serial.println(len);
+    Serial.println("======CoAP POST======");
+    const char* msg = "{\"temperature\":21.5,\"humidity\":40,\"pressure\":1013,\"battery\":3.61,\"rssi\":-85,\"uptime\":123456,\"device\":\"Test-123456\"}";
+    len = quectel.coapRequest(COAP_POST, "/sensors/temp", (const uint8_t*)msg, strlen(msg), response, sizeof(response), true, 50);	// 50 = application/json, payload is sent in two blocks
+    Serial.print("Response code: ");
+    Serial.println(quectel.getCoAPResponseCode(), HEX);
+    quectel.closeUDP();
+    Serial.println("======CoAP DONE======");
+    quectel.setDeepSleep(1);
+}
+
+void loop()
+{
+
+}
@@ -3,6 +3,16 @@
 #define SERIAL_PORT Serial2
 
 QuectelBC660 quectel = QuectelBC660(5, true);
+RTC_DATA_ATTR QuectelBC660::mqttSessionStruct session;     // Kept in RTC memory over ESP32 deep sleep
+RTC_DATA_ATTR QuectelBC660::latencyStruct latency[LATENCY_CLASSES];
+RTC_DATA_ATTR QuectelBC660::dnsCacheStruct dnsCache[DNS_CACHE_SIZE];
+
+void published(uint16_t msgID, uint8_t result)
+{
+    Serial.print("Message ");
+    Serial.print(msgID);
+    Serial.println(result == 0 ? " delivered" : " failed");
+}
 
 void setup() 
 {
@@ -10,6 +20,10 @@ void setup()
 	Serial.println("Quectel MQTT connection test");
 	Serial.println("===================");
 	quectel.begin(&SERIAL_PORT);
+    quectel.setLatencyStore(latency);
+    quectel.setAdaptiveTimeouts();
+    quectel.setDNSCacheStore(dnsCache);
+    quectel.setDNSCache();
     if(quectel.getRegistrationStatus(5))
     {
         Serial.println("Module is registered to network");
@@ -22,8 +36,34 @@ void setup()
     delay(1000);
     quectel.publishMQTT("Hello world!", 12, "MQTT/TOPIC");
     delay(1000);
+    quectel.publishMQTT("Hello world! Hello world! Hello world!", 38, "MQTT/TOPIC", 0, 0, 0, true);
+    delay(1000);
+    quectel.setMQTTPublishCallback(published);
+    for(uint8_t i = 0; i < 10; i++)
+    {
+        quectel.publishMQTTAsync("Hello world!", 12, "MQTT/TOPIC", 1);
+    }
+    Serial.print("Not delivered: ");
+    Serial.println(quectel.waitForMQTTPublished());
     quectel.closeMQTT();
     delay(1000);
+    Serial.println("======MQTT PERSISTENT SESSION======");
+    quectel.setMQTTSessionStore(&session);
+    quectel.setMQTTKeepAlive(3600);
+    quectel.setMQTTSession(false, 86400);
+    quectel.setMQTTWill("MQTT/STATUS", "offline", 1, 1);
+    if(quectel.ensureMQTTConnected("0.0.0.0", 1883, "Test-123456"))	// Replace 0.0.0.0 with address of your MQTT broker
+    {
+        Serial.print("Session resumed: ");
+        Serial.println(quectel.isMQTTSessionResumed());
+        quectel.publishMQTT("Hello again!", 12, "MQTT/TOPIC", 0, 1);
+    }
+    Serial.print("Reused: ");
+    Serial.print(session.reused);
+    Serial.print(", reconnected: ");
+    Serial.print(session.reconnected);
+    Serial.print(", reopened: ");
+    Serial.println(session.reopened);
     Serial.println("======MQTT SEND DONE======");
     quectel.setDeepSleep(1);
 }
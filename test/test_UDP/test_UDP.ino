@@ -16,12 +16,62 @@ void setup()
     }
     quectel.setDeepSleep();
     Serial.println("======UDP SEND======");
-    quectel.openUDP("0.0.0.0", 0);	// Replace 0.0.0.0 with your host IP adress and 0 with your PORT number
+    quectel.setRetryPolicy(3, 2000);
+    for(uint8_t attempt = 0; !quectel.openUDP("0.0.0.0", 0); attempt++)	// Replace 0.0.0.0 with your host IP adress and 0 with your PORT number
+    {
+        QuectelBC660::resultStruct result = quectel.getLastResult();
+        Serial.print("Open failed, cause: ");
+        Serial.print(result.cause);
+        Serial.print(", error code: ");
+        Serial.print(result.errorCode);
+        Serial.print(", stat code: ");
+        Serial.println(result.statCode);
+        if(!quectel.retryAfterFailure(attempt))
+        {
+            break;
+        }
+    }
     delay(1000);
     quectel.sendDataUDP("Hello world!", 12);
     delay(1000);
+    quectel.setUDPCompression();
+    const char* json = "{\"temp\":21.5,\"temp\":21.5,\"temp\":21.5}";
+    quectel.sendDataUDP(json, strlen(json));
+    Serial.print("Compression ratio: ");
+    Serial.println(quectel.getCompressionRatio());
+    delay(1000);
     quectel.closeUDP();
     delay(1000);
+    Serial.println("======UDP PIPELINED SEND======");
+    quectel.setUDPCompression(false);
+    quectel.setUDPSendMode(UDP_SEND_INLINE);
+    quectel.openUDP("0.0.0.0", 0);	// Replace 0.0.0.0 with your host IP adress and 0 with your PORT number
+    for(uint8_t i = 0; i < 8; i++)
+    {
+        quectel.queueDataUDP("Hello world!", 12);
+    }
+    Serial.print("Failed sends: ");
+    Serial.println(quectel.waitForUDPSent());
+    quectel.closeUDP();
+    Serial.println("======LINK HEALTH======");
+    quectel.pingHost("0.0.0.0");	// Replace 0.0.0.0 with your host IP adress
+    quectel.openUDP("0.0.0.0", 0);	// Replace with the IP adress and PORT number of a UDP echo server
+    quectel.probeUDPEcho(4);
+    quectel.closeUDP();
+    Serial.print("Ping RTT [ms]: ");
+    Serial.print(quectel.pingStats.averageRTT);
+    Serial.print(", jitter [ms]: ");
+    Serial.print(quectel.pingStats.jitter);
+    Serial.print(", loss [per mille]: ");
+    Serial.println(quectel.pingStats.loss);
+    Serial.print("Echo RTT [ms]: ");
+    Serial.print(quectel.echoStats.averageRTT);
+    Serial.print(", jitter [ms]: ");
+    Serial.print(quectel.echoStats.jitter);
+    Serial.print(", loss [per mille]: ");
+    Serial.print(quectel.echoStats.loss);
+    Serial.print(", RSRP: ");
+    Serial.println(quectel.echoStats.RSRP);
     Serial.println("======UDP SEND DONE======");
     quectel.setDeepSleep(1);
 }
@@ -3,6 +3,8 @@
 #define SERIAL_PORT Serial2
 
 QuectelBC660 quectel = QuectelBC660(5, true);
+RTC_DATA_ATTR QuectelBC660::attachCacheStruct attachCache;     // Kept in RTC memory over ESP32 deep sleep
+RTC_DATA_ATTR QuectelBC660::bandHistoryStruct bandHistory[BAND_HISTORY_SIZE];
 
 void setup() 
 {
@@ -25,7 +27,9 @@ void setup()
         Serial.println("ERROR!");
     }
     delay(1000);
-    Serial.println("=====Set bands to 8 and 20=====");
+    Serial.println("=====Set bands to 8 and 20 (learned order)=====");
+    quectel.setBandHistoryStore(bandHistory);
+    quectel.setBandLearning();
     uint8_t bands[2] = {8, 20};
     if(quectel.setManualBand(2,bands))
     {
@@ -46,6 +50,21 @@ void setup()
         Serial.println("ERROR!");
     }
     delay(1000);
+    Serial.println("=====Fast attach on cached cell=====");
+    quectel.setAttachCacheStore(&attachCache);
+    quectel.deregisterFromNetwork();
+    if(quectel.attachToNetwork())
+    {
+        Serial.print("Done! Fast attaches: ");
+        Serial.print(attachCache.fastAttaches);
+        Serial.print(", full scans: ");
+        Serial.println(attachCache.fullScans);
+    }
+    else 
+    {
+        Serial.println("ERROR!");
+    }
+    delay(1000);
     Serial.println("======TEST DONE======");
     quectel.setDeepSleep(1);
 }
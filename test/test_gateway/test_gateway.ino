@@ -0,0 +1,46 @@
+#include <Quectel_BC660.h>
+#include <Quectel_BC660_Gateway.h>
+
+QuectelBC660 quectel1 = QuectelBC660(5, true);
+QuectelBC660 quectel2 = QuectelBC660(18, true);
+QuectelBC660Gateway gateway = QuectelBC660Gateway(true);
+
+void setup() 
+{
+	Serial.begin(115200);
+	Serial.println("Quectel multi-modem gateway test");
+	Serial.println("===================");
+    quectel1.begin(&Serial1);
+    quectel2.begin(&Serial2);
+    quectel1.setUDPSendMode(UDP_SEND_INLINE);
+    quectel2.setUDPSendMode(UDP_SEND_INLINE);
+    quectel1.openUDP("0.0.0.0", 0);	// Replace 0.0.0.0 with your host IP adress and 0 with your PORT number
+    quectel2.openUDP("0.0.0.0", 0);
+    gateway.addModem(&quectel1);
+    gateway.addModem(&quectel2);
+    Serial.println("======GATEWAY SEND======");
+    for(uint8_t i = 0; i < 16; i++)
+    {
+        gateway.queueDataUDP("Hello world!", 12);
+    }
+    Serial.print("Failed sends: ");
+    Serial.println(gateway.flush());
+    for(uint8_t i = 0; i < 2; i++)
+    {
+        QuectelBC660Gateway::modemStatusStruct status = gateway.getModemStatus(i);
+        Serial.print("Modem ");
+        Serial.print(i);
+        Serial.print(": RSSI ");
+        Serial.print(status.RSSI);
+        Serial.print(" dBm, sent ");
+        Serial.println(status.sent);
+    }
+    quectel1.closeUDP();
+    quectel2.closeUDP();
+    Serial.println("======GATEWAY SEND DONE======");
+}
+
+void loop()
+{
+    gateway.loop();
+}